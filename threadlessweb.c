@@ -9,7 +9,8 @@
  * @section DESCRIPTION
  *
  * Provides a library for incorporating a simple threadless Webserver into your
- * code. Works on a polling basis using select and a user-definable timeout.
+ * code. Works on a polling basis using epoll, kqueue or select (whichever is
+ * available) and a user-definable timeout.
  * A callback can be set that's triggered on every request and allows a response
  * to be crafted based on what's received.
  *
@@ -24,430 +25,5911 @@
  *
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <limits.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "threadlessweb.h"
+
+// Defines
+
+#define BUFSIZE 8096
+
+// Receive buffers kept on the pool's free list for reuse
+#define BUFFER_POOL_MAX 1024
+
+// Largest request body held in memory for the callback, unless changed
+#define MAX_BODY_SIZE (1024 * 1024)
+// Longest line allowed in the framing of a chunked request body
+#define CHUNK_LINE_MAX 1024
+
+// Size of each block in a conversation's arena
+#define ARENA_BLOCK 4096
+#define ARENA_ALIGN 16
+// Allocations start after the block header, rounded up to keep them aligned
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+// Space for the response status line and headers
+#define HEADER_SIZE 256
+#define SEND_IOV 4
+
+// Largest slice of a file sent in one go
+#define FILE_CHUNK (1024 * 1024)
+
+// Bytes sent on a connection before the others get a turn, however fast it reads
+#define WRITE_BUDGET (256 * 1024)
+
+// Streamed chunks fill a pooled buffer, leaving room for the size line before
+// and the CRLF after; the length of a streamed response goes in its place
+#define STREAM_PREFIX 16
+#define STREAM_CHUNK (BUFSIZE - STREAM_PREFIX - 2)
+#define STREAM_END "0\r\n\r\n"
+#define LENGTH_CHUNKED ((size_t)-1)
+#define LENGTH_CLOSE ((size_t)-2)
+
+// Stop the library being killed by writes to closed sockets
+#if defined(MSG_NOSIGNAL)
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// Queue of pending connections, and how many to accept on each poll
+#define LISTEN_BACKLOG SOMAXCONN
+#define ACCEPT_BUDGET 64
+
+// Listening sockets a single server can poll
+#define LISTENERS_MAX 8
+
+// Response cache hash table size, and the most request headers it can vary on
+#define CACHE_BUCKETS 1024
+#define CACHE_VARY_MAX 4
+
+// Encoders compiled in; define COMPRESS_ZLIB for gzip and deflate, and
+// COMPRESS_BROTLI for br, linking with the matching library
+#if defined(COMPRESS_ZLIB)
+#include <zlib.h>
+#define ENCODINGS_ZLIB ((1 << ENCODING_DEFLATE) | (1 << ENCODING_GZIP))
+#else
+#define ENCODINGS_ZLIB 0
+#endif
+#if defined(COMPRESS_BROTLI)
+#include <brotli/encode.h>
+#define ENCODINGS_BROTLI (1 << ENCODING_BROTLI)
+#else
+#define ENCODINGS_BROTLI 0
+#endif
+#define ENCODINGS_AVAILABLE (ENCODINGS_ZLIB | ENCODINGS_BROTLI)
+
+// Responses compressed as they're sent favour speed; prepared ones, which are
+// only compressed once, favour size
+#define COMPRESS_ZLIB_LEVEL 6
+#define COMPRESS_ZLIB_LEVEL_BEST 9
+#define COMPRESS_BROTLI_QUALITY 5
+#define COMPRESS_BROTLI_QUALITY_BEST 11
+
+// Room kept free in a header for the Content-Encoding and Vary lines
+#define ENCODING_LINES_SIZE 64
+
+// The connection line goes last so that the rest of the header can be cached
+#define CONNECTION_KEEP_ALIVE "Connection: keep-alive\r\n\r\n"
+#define CONNECTION_CLOSE "Connection: close\r\n\r\n"
+
+// Sent before the body is read, to clients that wait to be asked for it
+#define CONTINUE_LINE "HTTP/1.1 100 Continue\r\n\r\n"
+
+// Where each part of a response sits in the send vector
+#define SEND_HEADER 0
+#define SEND_DATE 1
+#define SEND_CONNECTION 2
+#define SEND_BODY 3
+
+// Space for the stats report
+#define STATS_SIZE 2048
+
+// Persistent connection defaults
+#define KEEPALIVE_TIMEOUT_USEC 5E6
+#define KEEPALIVE_MAX_REQUESTS 100
+
+// How long a request may take to arrive, and a response may go without progress
+#define READ_TIMEOUT_USEC 10E6
+#define WRITE_TIMEOUT_USEC 30E6
+
+// How long, and for how many bytes, to keep reading from a refused connection
+#define LINGER_USEC 2E6
+#define LINGER_MAX (64 * 1024)
+#define LINGER_READ 4096
+
+// Connection deadlines are hashed into a wheel of slots, each a tick long
+#define TIMER_SLOTS 256
+#define TIMER_TICK_USEC 100000
+
+// Choose an event backend, unless one has been requested explicitly
+#if !defined(EVENTS_EPOLL) && !defined(EVENTS_KQUEUE) && !defined(EVENTS_SELECT) && !defined(EVENTS_URING)
+#if defined(__linux__)
+#define EVENTS_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+#define EVENTS_KQUEUE
+#else
+#define EVENTS_SELECT
+#endif
+#endif
+
+#if defined(EVENTS_EPOLL)
+#include <sys/epoll.h>
+#elif defined(EVENTS_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#include <sys/select.h>
+#endif
+
+#if defined(EVENTS_URING)
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Submission queue size; the completion queue is made twice as large
+#define URING_ENTRIES 1024
+// Completions tagged with this are for polls being withdrawn, so are ignored
+#define URING_IGNORE UINT64_MAX
+// Set on completions from a listener's accept, which carry its index in place of an fd
+#define URING_ACCEPT (1ULL << 63)
+// Most accepts each listener keeps with the kernel, each good for one connection
+#define URING_ACCEPTS 64
+// How long, in all, to wait for withdrawn accepts when another loop takes over
+#define URING_SETTLE_USEC 10000
+#define URING_SETTLE_TRIES 100
+#endif
+
+// Choose how request bytes are scanned, unless one has been requested explicitly
+#if !defined(SCAN_SSE2) && !defined(SCAN_AVX2) && !defined(SCAN_NEON) && !defined(SCAN_SCALAR)
+#if defined(__SSE2__)
+#define SCAN_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define SCAN_NEON
+#else
+#define SCAN_SCALAR
+#endif
+#endif
+
+// Header lines are short, so the wider AVX2 loads rarely pay for their setup;
+// define SCAN_AVX2 to use them anyway when the processor supports them
+#if defined(SCAN_AVX2) && !defined(SCAN_SSE2)
+#define SCAN_SSE2
+#endif
+
+#if defined(SCAN_SSE2)
+#include <immintrin.h>
+#elif defined(SCAN_NEON)
+#include <arm_neon.h>
+#endif
+
+// Maximum number of ready descriptors returned by a single poll
+#define EVENTS_MAX 256
+
+// Connection slots are allocated in chunks that never move
+#define CONNECTION_CHUNK 64
+#define CONNECTION_FDS_INITIAL 64
+
+// Recover the connection that holds a given conversation
+#define CONNECTION(conversation_) ((Connection *)((char *)(conversation_) - offsetof(Connection, conversation)))
+
+#define RESPONSE_CONTENT "Okay\n"
+#define RESPONSE_TYPE "text/html"
+#define RESPONSE_LENGTH (sizeof(RESPONSE_CONTENT) - 1)
+
+#define FORBIDDEN_TEXT "<html><head>\n<title>403 Forbidden</title>\n</head><body>\n<h1>Forbidden</h1>\nThe requested URL, file type or operation is not allowed on this simple static file webserver.\n</body></html>\n"
+#define BAD_REQUEST_TEXT "<html><head>\n<title>400 Bad Request</title>\n</head><body>\n<h1>Bad Request</h1>\nThe request could not be understood.\n</body></html>\n"
+#define TOO_LARGE_TEXT "<html><head>\n<title>413 Content Too Large</title>\n</head><body>\n<h1>Content Too Large</h1>\nThe request body is larger than this server accepts.\n</body></html>\n"
+#define HEADER_TOO_LARGE_TEXT "<html><head>\n<title>431 Request Header Fields Too Large</title>\n</head><body>\n<h1>Request Header Fields Too Large</h1>\nThe request header is larger than this server accepts.\n</body></html>\n"
+#define TOO_MANY_TEXT "<html><head>\n<title>429 Too Many Requests</title>\n</head><body>\n<h1>Too Many Requests</h1>\nToo many connections have been made from this address. Please try again later.\n</body></html>\n"
+#define UNAVAILABLE_TEXT "<html><head>\n<title>503 Service Unavailable</title>\n</head><body>\n<h1>Service Unavailable</h1>\nThe server is too busy to handle the request.\n</body></html>\n"
+
+// Responses sent when a request is refused, each followed by the connection closing
+#define REFUSALS_NUM 6
+
+// How long to stop accepting for when out of descriptors
+#define ACCEPT_BACKOFF_USEC 1E5
+
+// Clients' connection rates are tracked in a fixed table, each address
+// probing a few slots and taking over the least recently seen if it's new
+#define RATE_BUCKETS_BITS 12
+#define RATE_BUCKETS (1 << RATE_BUCKETS_BITS)
+#define RATE_PROBES 4
+// Tokens are counted in millionths so refills needn't be rounded
+#define RATE_TOKEN 1000000
+
+// Pipelined requests answered on a connection before the others get a turn
+#define REQUESTS_PER_TURN 8
+
+// The Date and Server lines are shared by every response, and change once a second
+#define DATE_SIZE 64
+
+// Levels above this are compiled out entirely
+#if !defined(LOG_LEVEL_MAX)
+#define LOG_LEVEL_MAX LOG_DEBUG
+#endif
+
+// Levels up to this are logged unless set_log_level says otherwise
+#define LOG_LEVEL_DEFAULT LOG_WARNING
+
+// Arguments are only evaluated if the message will actually be logged
+#define LOG(webserve_, level_, ...) do { \
+		if (((level_) <= LOG_LEVEL_MAX) && ((level_) <= (((webserve_) != NULL) ? ((Webserve *)(webserve_))->log_level : LOG_LEVEL_DEFAULT))) { \
+			log_write((webserve_), (level_), __VA_ARGS__); \
+		} \
+	} while (false)
+
+// Space for each message held in the asynchronous log ring
+#define LOG_MESSAGE_SIZE 240
+
+// Structure definitions
+
+static char const * const requests[] = {
+	"GET",
+	"POST",
+	"HEAD",
+	"PUT",
+	"DELETE",
+	"OPTIONS",
+	"PATCH",
+	"CONNECT",
+	"TRACE"
+};
+
+typedef struct _StatusLine {
+	int code;
+	char const * line;
+} StatusLine;
+
+static StatusLine const status_lines[] = {
+	{200, "HTTP/1.1 200 OK\r\n"},
+	{201, "HTTP/1.1 201 Created\r\n"},
+	{202, "HTTP/1.1 202 Accepted\r\n"},
+	{204, "HTTP/1.1 204 No Content\r\n"},
+	{206, "HTTP/1.1 206 Partial Content\r\n"},
+	{301, "HTTP/1.1 301 Moved Permanently\r\n"},
+	{302, "HTTP/1.1 302 Found\r\n"},
+	{303, "HTTP/1.1 303 See Other\r\n"},
+	{304, "HTTP/1.1 304 Not Modified\r\n"},
+	{307, "HTTP/1.1 307 Temporary Redirect\r\n"},
+	{308, "HTTP/1.1 308 Permanent Redirect\r\n"},
+	{400, "HTTP/1.1 400 Bad Request\r\n"},
+	{401, "HTTP/1.1 401 Unauthorized\r\n"},
+	{403, "HTTP/1.1 403 Forbidden\r\n"},
+	{404, "HTTP/1.1 404 Not Found\r\n"},
+	{405, "HTTP/1.1 405 Method Not Allowed\r\n"},
+	{408, "HTTP/1.1 408 Request Timeout\r\n"},
+	{411, "HTTP/1.1 411 Length Required\r\n"},
+	{413, "HTTP/1.1 413 Content Too Large\r\n"},
+	{414, "HTTP/1.1 414 URI Too Long\r\n"},
+	{429, "HTTP/1.1 429 Too Many Requests\r\n"},
+	{431, "HTTP/1.1 431 Request Header Fields Too Large\r\n"},
+	{500, "HTTP/1.1 500 Internal Server Error\r\n"},
+	{501, "HTTP/1.1 501 Not Implemented\r\n"},
+	{503, "HTTP/1.1 503 Service Unavailable\r\n"}
+};
+
+typedef struct _Refusal {
+	int code;
+	char const * text;
+} Refusal;
+
+static Refusal const refusals[REFUSALS_NUM] = {
+	{400, BAD_REQUEST_TEXT},
+	{RESPONSE_FORBIDDEN, FORBIDDEN_TEXT},
+	{413, TOO_LARGE_TEXT},
+	{429, TOO_MANY_TEXT},
+	{431, HEADER_TOO_LARGE_TEXT},
+	{503, UNAVAILABLE_TEXT}
+};
+
+typedef struct _KnownHeader {
+	char const * name;
+	unsigned int hash;
+} KnownHeader;
+
+// In HEADER order, with the hash of each lower case name
+static KnownHeader const known_headers[HEADER_KNOWN_NUM] = {
+	{"Host", 0xaffea56f},
+	{"Content-Length", 0x4df9451d},
+	{"Content-Type", 0xfcf70995},
+	{"Connection", 0x38b99ed9},
+	{"Transfer-Encoding", 0xddb4744c},
+	{"Accept-Encoding", 0xc9715a99},
+	{"Expect", 0x96da6b58},
+	{"Cookie", 0x77a740bf}
+};
+
+typedef enum {
+	PARSE_HEADER,
+	PARSE_BODY,
+	PARSE_COMPLETE,
+	PARSE_LINGER
+} PARSE;
+
+// In increasing order of preference, for when the client doesn't mind which
+typedef enum {
+	ENCODING_IDENTITY,
+	ENCODING_DEFLATE,
+	ENCODING_GZIP,
+	ENCODING_BROTLI,
+	ENCODING_NUM
+} ENCODING;
+
+static char const * const encodings[ENCODING_NUM] = {
+	"identity",
+	"deflate",
+	"gzip",
+	"br"
+};
+
+typedef enum {
+	CHUNK_SIZE,
+	CHUNK_DATA,
+	CHUNK_DATA_END,
+	CHUNK_TRAILER
+} CHUNK;
+
+typedef enum {
+	READ_INCOMPLETE,
+	READ_COMPLETE,
+	READ_CLOSED,
+	READ_ERROR
+} READ;
+
+typedef enum {
+	WRITE_PENDING,
+	WRITE_COMPLETE,
+	WRITE_ERROR
+} WRITE;
+
+typedef enum {
+	TIMER_NONE,
+	TIMER_READ,
+	TIMER_IDLE,
+	TIMER_WRITE,
+	TIMER_LINGER
+} TIMER;
+
+typedef struct _BufferPool {
+	// Unused buffers, linked through their first bytes
+	char * free;
+	unsigned int free_num;
+} BufferPool;
+
+typedef struct _ArenaBlock ArenaBlock;
+
+struct _ArenaBlock {
+	ArenaBlock * next;
+	size_t size;
+	size_t used;
+};
+
+typedef struct _LogEntry {
+	int level;
+	char message[LOG_MESSAGE_SIZE];
+} LogEntry;
+
+typedef struct _LogRing {
+	// Single producer (the polling thread), consumers take turns to flush
+	LogEntry * entries;
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+	bool flushing;
+	unsigned long dropped;
+} LogRing;
+
+typedef struct _CacheEntry CacheEntry;
+
+struct _CacheEntry {
+	unsigned int hash;
+	CacheEntry * chain;
+	// Most recently used first
+	CacheEntry * newer;
+	CacheEntry * older;
+	uint64_t expires;
+	// Connections still sending from the entry, which keep it alive if evicted
+	unsigned int references;
+	bool evicted;
+	size_t size;
+	char * key;
+	size_t key_size;
+	char * header;
+	size_t header_size;
+	char * body;
+	size_t body_size;
+	char data[];
+};
+
+struct _WebserveResponse {
+	WebserveResponse * next;
+	char * header;
+	size_t header_size;
+	char * body;
+	size_t body_size;
+	// Kept so that compressed variants can be given matching headers
+	int code;
+	char * type;
+	// Copies of the response for each encoding, made when it was added; the
+	// identity copy differs only in saying that the response varies
+	WebserveResponse * variants[ENCODING_NUM];
+	unsigned int encodings;
+	// Connections still sending a variant, which keep it alive once replaced
+	unsigned int references;
+	bool retired;
+	char data[];
+};
+
+typedef struct _ResponseCache {
+	CacheEntry ** buckets;
+	CacheEntry * newest;
+	CacheEntry * oldest;
+	size_t size;
+	size_t max_size;
+	unsigned int ttl_usec;
+	char * vary[CACHE_VARY_MAX];
+	unsigned int vary_num;
+} ResponseCache;
+
+typedef struct _Connection Connection;
+
+struct _Connection {
+	// Fields touched on every event are kept together at the front
+	int fd;
+	int interest;
+	PARSE parse;
+	Connection * next;
+	Connection * prev;
+	// Incremental request parsing state
+	char * buffer;
+	size_t buffer_size;
+	size_t buffer_used;
+	size_t scanned;
+	size_t path_start;
+	size_t path_end;
+	size_t line_end;
+	size_t header_size;
+	size_t content_length;
+	size_t request_end;
+	// The body is read from body_raw and kept from header_size up to body_end
+	size_t body_raw;
+	size_t body_end;
+	size_t body_received;
+	bool body_chunked;
+	CHUNK chunk;
+	size_t chunk_remaining;
+	// Read and thrown away since the request was refused
+	size_t discarded;
+	// Persistent connection state
+	bool keep_alive;
+	unsigned int requests;
+	uint64_t request_start;
+	// Deadline for whatever the connection is waiting on, in the timer wheel
+	TIMER timer;
+	uint64_t timer_tick;
+	Connection * timer_next;
+	Connection * timer_prev;
+	// Queued to answer more pipelined requests once the others have had a turn
+	bool pending;
+	Connection * pending_next;
+	Connection * pending_prev;
+	// Memory handed out by conv_alloc, released when the conversation ends
+	ArenaBlock * arena;
+	// Response being sent, with a cursor so partial writes can resume
+	struct iovec send[SEND_IOV];
+	int send_num;
+	int send_pos;
+	bool corked;
+	// Waiting for the response to be completed, perhaps by another thread
+	bool deferred;
+	Connection * completed_next;
+	off_t file_offset;
+	size_t file_remaining;
+	// Streamed responses are produced a chunk at a time into their own buffer
+	bool streaming;
+	bool chunked;
+	char * stream;
+	CacheEntry * cached;
+	WebserveResponse * variant;
+	char header[HEADER_SIZE];
+	WebserveConv conversation;
+};
+
+typedef struct _ConnectionTable {
+	// Slab of connection slots, with unused ones on a free list
+	Connection ** chunks;
+	unsigned int chunks_num;
+	Connection * free;
+	// Live connections, for sweeps that shouldn't walk the fd space
+	Connection * live;
+	unsigned int live_num;
+	// Map from descriptor to live connection
+	Connection ** fds;
+	int fds_size;
+} ConnectionTable;
+
+typedef struct _TimerWheel {
+	// Connections hashed by the tick their deadline falls in
+	Connection * slots[TIMER_SLOTS];
+	// The next tick to be checked for expired deadlines
+	uint64_t tick;
+	unsigned int num;
+} TimerWheel;
+
+#if defined(EVENTS_URING)
+typedef struct _UringPoll {
+	// Bumped whenever the poll is replaced, so stale completions can be spotted
+	uint32_t generation;
+	int interest;
+	bool armed;
+} UringPoll;
+
+typedef struct _UringAccept {
+	int interest;
+	// A bit for each accept with the kernel; between them and the queue there
+	// are never more than URING_ACCEPTS, so the queue can't overflow
+	uint64_t outstanding;
+	// Connections the kernel has accepted that haven't been taken yet
+	int queue[URING_ACCEPTS];
+	unsigned int head;
+	unsigned int num;
+	// An accept that failed, reported once the queue has been emptied
+	int error;
+} UringAccept;
+
+typedef struct _UringRing {
+	// Submission queue, shared with the kernel
+	unsigned int * sq_head;
+	unsigned int * sq_tail;
+	unsigned int * sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_pending;
+	struct io_uring_sqe * sqes;
+	// Completion queue, shared with the kernel
+	unsigned int * cq_head;
+	unsigned int * cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe * cqes;
+	// Mappings to undo on the way out
+	void * sq_map;
+	size_t sq_map_size;
+	void * cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+	// Polls are one-shot, so each descriptor's state is tracked here
+	UringPoll * polls;
+	int polls_size;
+	// How many of the ready descriptors need their polls arming again
+	int fired;
+	// Each listener accepts through the ring
+	UringAccept accepts[LISTENERS_MAX];
+} UringRing;
+#endif
+
+typedef struct _RateBucket {
+	// IPv4 clients are held as IPv4-mapped IPv6 addresses, and IPv6 ones by the
+	// /64 network they're on, since that's usually what a single host is given
+	uint8_t address[16];
+	uint64_t tokens;
+	// Zero for a slot that's never been used
+	uint64_t updated;
+} RateBucket;
+
+typedef struct _RateLimit {
+	RateBucket * buckets;
+	// Connections allowed per second, and how many can be saved up
+	unsigned int rate;
+	unsigned int burst;
+} RateLimit;
+
+typedef struct _Listener {
+	int fd;
+	int family;
+	// Socket file to remove when the server finishes, for Unix domain sockets
+	char * path;
+} Listener;
+
+typedef struct _RouteNode RouteNode;
+
+struct _RouteNode {
+	// Literal text matched on the way in to this node
+	char * prefix;
+	size_t prefix_size;
+	// Literal children, sorted by their first character
+	RouteNode ** children;
+	char * firsts;
+	unsigned int children_num;
+	// Child matching a single path segment
+	RouteNode * param;
+	char * param_name;
+	// Callbacks for paths ending here, and for any path continuing from here
+	WebservConvCallback callbacks[REQUEST_NUM + 1];
+	WebservConvCallback wildcard[REQUEST_NUM + 1];
+};
+
+struct _Webserve {
+	Listener listeners[LISTENERS_MAX];
+	unsigned int listeners_num;
+	int hit;
+#if defined(EVENTS_EPOLL)
+	int pollfd;
+	struct epoll_event backend_events[EVENTS_MAX];
+#elif defined(EVENTS_KQUEUE)
+	int pollfd;
+	struct kevent backend_events[EVENTS_MAX];
+#elif defined(EVENTS_URING)
+	int pollfd;
+	UringRing ring;
+#else
+	fd_set active_read_fd_set;
+	fd_set active_write_fd_set;
+	int maxfd;
+	int nextfd;
+#endif
+	WebserveEvent ready[EVENTS_MAX];
+	// Set when another event loop is watching the descriptors instead
+	WebserveFdCallback fd_callback;
+	void * fd_callback_data;
+	unsigned int timeout_usec;
+	// Polls don't block for this long after the last activity
+	unsigned int spin_usec;
+	uint64_t active_usec;
+	unsigned int busy_poll_usec;
+	unsigned int keepalive_timeout_usec;
+	unsigned int keepalive_max_requests;
+	size_t max_body_size;
+	WebserveBodyCallback body_callback;
+	unsigned int read_timeout_usec;
+	unsigned int write_timeout_usec;
+	TimerWheel timers;
+	int listen_backlog;
+	unsigned int accept_budget;
+	WebserveStats stats;
+	int log_level;
+	LogRing log;
+	char * stats_path;
+	WebservConvCallback conversation_callback;
+	RouteNode * routes;
+	ResponseCache cache;
+	// Bodies at least this large are compressed, if the client allows it
+	size_t compress_min_size;
+	WebserveResponse * responses;
+	WebserveResponse * refusals[REFUSALS_NUM];
+	// Kept open so a descriptor can be freed up to turn a client away
+	int spare_fd;
+	uint64_t accept_paused_until;
+	unsigned int max_connections;
+	RateLimit rate;
+	// Connections with pipelined requests still to answer, oldest first
+	Connection * pending;
+	Connection * pending_last;
+	// Two copies, so a line still being sent isn't changed beneath it
+	char date[2][DATE_SIZE];
+	size_t date_size;
+	unsigned int date_current;
+	time_t date_time;
+	ConnectionTable connections;
+	BufferPool buffers;
+	// Deferred conversations completed since the last poll, and how to wake it
+	Connection * completed;
+	int wake_read;
+	int wake_write;
+	bool quit;
+};
+
+typedef struct _PoolWorker {
+	WebservePool * pool;
+	unsigned int index;
+	Webserve * webserve;
+	pthread_t thread;
+	bool started;
+} PoolWorker;
+
+struct _WebservePool {
+	unsigned int size;
+	bool affinity;
+	PoolWorker * workers;
+};
+
+// Function prototypes
+
+void log_write(Webserve * webserve, int level, char const * format, ...) __attribute__((format(printf, 3, 4)));
+void * receive_request(void * t);
+void spawn_receive(int fd, int hit);
+void refuse(Webserve * webserve, int socket_fd, int code);
+void refuse_close(Webserve * webserve, int socket_fd, int code);
+void accept_pause(Webserve * webserve);
+void accept_resume(Webserve * webserve);
+bool rate_key(struct sockaddr_storage const * client, uint8_t * address);
+bool rate_admit(Webserve * webserve, uint8_t const * address);
+void pending_add(Webserve * webserve, Connection * connection);
+void pending_remove(Webserve * webserve, Connection * connection);
+void pending_process(Webserve * webserve);
+bool set_nonblocking(int fd);
+Webserve * check_connect(int listenfd);
+int start_listening(int port, bool reuseport, int backlog);
+int listen_socket(Webserve * webserve, struct sockaddr const * address, socklen_t size, WebserveListenOptions const * options, int backlog);
+bool listener_add(Webserve * webserve, int fd, int family, char const * path);
+Listener * listener_find(Webserve * webserve, int fd);
+bool pool_pin_thread(WebservePool * pool, unsigned int index);
+void * pool_worker(void * data);
+bool content_length_parse(char const * value, size_t size, size_t * length);
+READ web_read(Webserve * webserve, int fd, Connection * connection);
+READ web_parse(Webserve * webserve, int fd, Connection * connection);
+READ web_parse_body(Webserve * webserve, int fd, Connection * connection);
+void web_parse_request(Connection * connection, size_t boundary);
+unsigned int header_hash(char const * name, size_t size);
+char const * header_find(char const * header, size_t size, char const * name, size_t * value_size);
+bool header_has_token(char const * value, size_t size, char const * token);
+size_t scan_find(char const * data, size_t size, char first, char second);
+size_t scan_find_scalar(char const * data, size_t size, char first, char second);
+#if defined(SCAN_SSE2)
+size_t scan_find_sse2(char const * data, size_t size, char first, char second);
+#endif
+#if defined(SCAN_AVX2)
+size_t scan_find_avx2(char const * data, size_t size, char first, char second) __attribute__((target("avx2")));
+#endif
+#if defined(SCAN_NEON)
+size_t scan_find_neon(char const * data, size_t size, char first, char second);
+#endif
+void web_prepare(Webserve * webserve, Connection * connection);
+void web_prepare_shared(Webserve * webserve, Connection * connection);
+size_t header_build(char * header, size_t size, int code, size_t length, char const * type);
+WebserveResponse * response_build(int code, char const * type, void const * body, size_t size);
+WebserveResponse * response_variant(WebserveResponse const * response, ENCODING encoding, char const * body, size_t size);
+void response_compress(Webserve * webserve, WebserveResponse * response);
+void response_free(WebserveResponse * response);
+void response_retire(WebserveResponse * variant);
+void response_release(WebserveResponse * variant);
+ENCODING encoding_choose(WebserveConv const * conversation, unsigned int available);
+size_t encoding_parameter(char const * value, size_t size, size_t pos, int * q);
+bool encoding_compressible(char const * type);
+size_t encoding_compress(ENCODING encoding, bool best, void const * data, size_t size, char * out);
+size_t header_encoding(char * header, size_t position, ENCODING encoding);
+void date_update(Webserve * webserve);
+WRITE web_write(Webserve * webserve, int fd, Connection * connection);
+void socket_cork(int fd, bool cork);
+ssize_t web_write_file(int fd, Connection * connection);
+bool web_produce(Webserve * webserve, Connection * connection);
+ssize_t web_write_mapped(int fd, Connection * connection, size_t count);
+void socket_nodelay(int fd);
+void socket_busy_poll(Webserve * webserve, int fd);
+Connection * conversation_new(Webserve * webserve, int fd);
+void conversation_clear(Webserve * webserve, int fd);
+Connection * conversation_get(Webserve * webserve, int fd);
+void connections_finish(Webserve * webserve);
+void timer_set(Webserve * webserve, Connection * connection, TIMER timer);
+void timer_cancel(Webserve * webserve, Connection * connection);
+void timers_expire(Webserve * webserve);
+unsigned int timers_timeout(Webserve * webserve);
+unsigned int accept_connections(Webserve * webserve, Listener * listener);
+int listener_accept(Webserve * webserve, Listener * listener, struct sockaddr_storage * client, socklen_t * size);
+void histogram_record(WebserveHistogram * histogram, uint64_t value);
+void stats_respond(Webserve * webserve, WebserveConv * conversation);
+bool request_path_is(Connection * connection, char const * path);
+RouteNode * route_new(char const * prefix, size_t size);
+RouteNode * route_insert(RouteNode * node, char const * literal, size_t size);
+WebservConvCallback route_find(RouteNode * node, char const * path, size_t size, REQUEST method, WebserveConv * conversation);
+WebservConvCallback route_callback(WebservConvCallback const * callbacks, REQUEST method);
+void routes_finish(RouteNode * node);
+CacheEntry * cache_lookup(Webserve * webserve, WebserveConv * conversation, char ** key, size_t * key_size);
+void cache_store(Webserve * webserve, Connection * connection, char const * key, size_t key_size);
+void cache_send(Webserve * webserve, Connection * connection, CacheEntry * entry);
+void cache_remove(ResponseCache * cache, CacheEntry * entry);
+void cache_release(CacheEntry * entry);
+void cache_finish(Webserve * webserve);
+void conversation_process(Webserve * webserve, Connection * connection);
+bool conversation_send(Webserve * webserve, Connection * connection);
+void conversation_resume(Webserve * webserve, Connection * connection);
+bool wake_init(Webserve * webserve);
+void wake_finish(Webserve * webserve);
+void wake_drain(Webserve * webserve);
+void wake_signal(Webserve * webserve);
+void completions_process(Webserve * webserve);
+void conversation_respond(Webserve * webserve, Connection * connection);
+bool conversation_finish(Webserve * webserve, Connection * connection);
+void conversation_close(Webserve * webserve, Connection * connection);
+void conversation_linger(Webserve * webserve, Connection * connection);
+READ web_linger(Webserve * webserve, int fd, Connection * connection);
+void conversation_reset(Webserve * webserve, Connection * connection);
+void conversation_free_content(WebserveConv * conversation);
+bool arena_contains(Connection * connection, void const * memory);
+void arena_reset(Connection * connection);
+char * buffer_acquire(Webserve * webserve);
+void buffer_release(Webserve * webserve, char * buffer);
+void buffers_finish(Webserve * webserve);
+bool request_buffer_grow(Webserve * webserve, Connection * connection, size_t size);
+void request_buffer_release(Webserve * webserve, Connection * connection);
+uint64_t time_usec();
+bool default_conv_callback(WebserveConv * request);
+bool poll_events(Webserve * webserve, unsigned int limit_usec);
+bool events_init(Webserve * webserve);
+void events_finish(Webserve * webserve);
+bool events_update(Webserve * webserve, int fd, int from, int to);
+bool backend_update(Webserve * webserve, int fd, int from, int to);
+int events_wait(Webserve * webserve, unsigned int timeout_usec);
+#if defined(EVENTS_URING)
+bool uring_queue(Webserve * webserve, int opcode, int fd, unsigned int events, uint64_t user_data, uint64_t addr);
+int uring_enter(Webserve * webserve, unsigned int timeout_usec);
+bool uring_arm(Webserve * webserve, int fd);
+int uring_reap(Webserve * webserve);
+bool uring_accept_update(Webserve * webserve, unsigned int index, int to);
+bool uring_accept_arm(Webserve * webserve, unsigned int index);
+unsigned int uring_accept_room(Webserve * webserve);
+void uring_accept_complete(Webserve * webserve, struct io_uring_cqe const * cqe);
+int uring_accept_ready(Webserve * webserve, int count);
+int uring_accepted(Webserve * webserve, unsigned int index);
+void uring_accept_settle(Webserve * webserve);
+void uring_accept_limit(Webserve * webserve);
+#endif
+unsigned int events_dispatch(Webserve * webserve, int fd, int events);
+void events_housekeeping(Webserve * webserve, unsigned int accepted);
+
+// Function definitions
+
+bool content_length_parse(char const * value, size_t size, size_t * length) {
+	size_t pos;
+	size_t parsed;
+	size_t digits;
+	bool first;
+	bool valid;
+
+	// Only digits, though a list of the same length repeated is tolerated
+	pos = 0;
+	first = true;
+	valid = true;
+	*length = 0;
+	while (valid && ((pos < size) || first)) {
+		while ((pos < size) && ((value[pos] == ' ') || (value[pos] == '\t'))) {
+			pos++;
+		}
+		parsed = 0;
+		for (digits = 0; (pos < size) && isdigit((unsigned char)value[pos]); digits++) {
+			if (parsed > (SIZE_MAX - (value[pos] - '0')) / 10) {
+				valid = false;
+			}
+			parsed = (parsed * 10) + (value[pos] - '0');
+			pos++;
+		}
+		while ((pos < size) && ((value[pos] == ' ') || (value[pos] == '\t'))) {
+			pos++;
+		}
+		if ((digits == 0) || ((first == false) && (parsed != *length))) {
+			valid = false;
+		}
+		else if ((pos < size) && (value[pos] != ',')) {
+			valid = false;
+		}
+		else if (pos < size) {
+			// Something has to follow the comma
+			pos++;
+			valid = (pos < size);
+		}
+		*length = parsed;
+		first = false;
+	}
+
+	return valid;
+}
+
+READ web_read(Webserve * webserve, int fd, Connection * connection) {
+	long ret;
+
+	if (connection->parse == PARSE_LINGER) {
+		return web_linger(webserve, fd, connection);
+	}
+
+	if (connection->buffer == NULL) {
+		connection->buffer = buffer_acquire(webserve);
+		connection->buffer_size = BUFSIZE;
+		connection->buffer_used = 0;
+		if (connection->buffer == NULL) {
+			refuse(webserve, fd, 503);
+			LOG(webserve, LOG_WARNING, "REFUSED: Failed to allocate request buffer, %d\n", fd);
+			return READ_ERROR;
+		}
+	}
+
+	// Read whatever has arrived so far, without blocking
+	ret = 1;
+	while (((ret > 0) && (connection->buffer_used < connection->buffer_size)) || ((ret < 0) && (errno == EINTR))) {
+		ret = read(fd, connection->buffer + connection->buffer_used, connection->buffer_size - connection->buffer_used);
+		if (ret > 0) {
+			if (connection->buffer_used == 0) {
+				// The clock starts when the first byte of a request arrives
+				connection->request_start = time_usec();
+			}
+			connection->buffer_used += ret;
+			webserve->stats.bytes_in += ret;
+		}
+	}
+
+	if ((ret == 0) && (connection->buffer_used == 0)) {
+		// The client closed the connection between requests
+		return READ_CLOSED;
+	}
+
+	if (ret == 0) {
+		// Half a request and then nothing more can follow
+		refuse(webserve, fd, 400);
+		LOG(webserve, LOG_WARNING, "REFUSED: Request cut short, %d\n", fd);
+		return READ_ERROR;
+	}
+
+	if ((ret < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		// Reset by the client, most likely, so there's no one to tell
+		LOG(webserve, LOG_INFO, "INFO: Failed to read browser request, %d\n", fd);
+		return READ_CLOSED;
+	}
+
+	return web_parse(webserve, fd, connection);
+}
+
+READ web_parse(Webserve * webserve, int fd, Connection * connection) {
+	long i;
+	WebserveConv * conversation;
+	int request;
+	REQUEST type;
+	int size;
+	int hit;
+	size_t boundary;
+	char const * value;
+	size_t value_size;
+
+	conversation = &connection->conversation;
+	hit = conversation->hit;
+
+	// Terminate the buffer
+	connection->buffer[connection->buffer_used] = 0;
+
+	if (connection->parse == PARSE_HEADER) {
+		// Find the path, the end of the request line and the boundary between
+		// header and body in a single pass, resuming where we left off
+		boundary = 0;
+		i = connection->scanned;
+		while ((boundary == 0) && (i < connection->buffer_used)) {
+			if (connection->line_end == 0) {
+				i += scan_find(connection->buffer + i, connection->buffer_used - i, ' ', '\n');
+			}
+			else {
+				i += scan_find(connection->buffer + i, connection->buffer_used - i, '\n', '\n');
+			}
+			if (i < connection->buffer_used) {
+				if (connection->buffer[i] == ' ') {
+					// The path sits between the first two spaces of the request line
+					if (connection->path_start == 0) {
+						connection->path_start = i + 1;
+					}
+					else if (connection->path_end == 0) {
+						connection->path_end = i;
+					}
+				}
+				else if (connection->line_end == 0) {
+					connection->line_end = i + 1;
+					if ((connection->path_start > 0) && (connection->path_end == 0)) {
+						// No protocol version, so the path runs to the end of the line
+						connection->path_end = ((i > connection->path_start) && (connection->buffer[i - 1] == '\r')) ? i - 1 : i;
+					}
+				}
+				else if (connection->buffer[i - 1] == '\n') {
+					boundary = i + 1;
+				}
+				else if ((i >= 3) && (memcmp(connection->buffer + i - 3, "\r\n\r\n", 4) == 0)) {
+					boundary = i + 1;
+				}
+				i++;
+			}
+		}
+		connection->scanned = i;
+
+		if (boundary > 0) {
+			connection->header_size = boundary;
+			connection->parse = PARSE_BODY;
+
+			web_parse_request(connection, boundary);
+
+			// A chunked body takes precedence over any length given
+			connection->content_length = 0;
+			connection->body_chunked = false;
+			value = conversation->known[HEADER_TRANSFER_ENCODING].data;
+			value_size = conversation->known[HEADER_TRANSFER_ENCODING].size;
+			if (value != NULL) {
+				connection->body_chunked = header_has_token(value, value_size, "chunked");
+				if (connection->body_chunked == false) {
+					refuse(webserve, fd, 400);
+					LOG(webserve, LOG_WARNING, "REFUSED: Transfer encoding not supported: %.*s: %d\n", (int)value_size, value, fd);
+					return READ_ERROR;
+				}
+			}
+			else {
+				value = conversation->known[HEADER_CONTENT_LENGTH].data;
+				value_size = conversation->known[HEADER_CONTENT_LENGTH].size;
+				if ((value != NULL) && (content_length_parse(value, value_size, &connection->content_length) == false)) {
+					refuse(webserve, fd, 400);
+					LOG(webserve, LOG_WARNING, "REFUSED: Invalid content length: %.*s: %d\n", (int)value_size, value, fd);
+					return READ_ERROR;
+				}
+			}
+			connection->body_raw = boundary;
+			connection->body_end = boundary;
+			connection->body_received = 0;
+			connection->chunk = CHUNK_SIZE;
+			connection->chunk_remaining = 0;
+
+			// HTTP/1.1 persists by default, HTTP/1.0 only if asked to
+			connection->keep_alive = (conversation->version >= 11);
+			value = conversation->known[HEADER_CONNECTION].data;
+			value_size = conversation->known[HEADER_CONNECTION].size;
+			if (value != NULL) {
+				if (header_has_token(value, value_size, "close")) {
+					connection->keep_alive = false;
+				}
+				else if (header_has_token(value, value_size, "keep-alive")) {
+					connection->keep_alive = true;
+				}
+			}
+			// Sending both framings is how requests get smuggled past proxies that
+			// read the other one, so the connection isn't trusted any further
+			if ((connection->body_chunked) && (conversation->known[HEADER_CONTENT_LENGTH].data != NULL)) {
+				connection->keep_alive = false;
+			}
+
+			// A request line without a method and path can't be understood at all
+			if ((conversation->method.size == 0) || (connection->path_end <= connection->path_start)) {
+				refuse(webserve, fd, 400);
+				LOG(webserve, LOG_WARNING, "REFUSED: Malformed request line, %d\n", fd);
+				return READ_ERROR;
+			}
+
+			// Figure out what sort of request this is (GET, POST?)
+			type = REQUEST_INVALID;
+			for (request = 0; (request < REQUEST_NUM) && (type == REQUEST_INVALID); request++) {
+				size = strlen(requests[request]);
+				if ((conversation->method.size == size) && (strncasecmp(conversation->method.data, requests[request], size) == 0)) {
+					type = request;
+				}
+			}
+			conversation->type = type;
+
+			// Not all HTTP operations are supported
+			if ((type <= REQUEST_INVALID) || (type >= REQUEST_NUM)) {
+				refuse(webserve, fd, RESPONSE_FORBIDDEN);
+				LOG(webserve, LOG_WARNING, "FORBIDDEN: Operation not supported: %.*s: %d\n", (int)conversation->method.size, conversation->method.data, fd);
+				return READ_ERROR;
+			}
+
+			if (webserve->body_callback == NULL) {
+				// The whole body has to fit in memory, so make room for it up front
+				if (connection->content_length > webserve->max_body_size) {
+					refuse(webserve, fd, 413);
+					LOG(webserve, LOG_WARNING, "REFUSED: Request body too large, %d\n", fd);
+					return READ_ERROR;
+				}
+				if ((boundary + connection->content_length > connection->buffer_size) && (request_buffer_grow(webserve, connection, boundary + connection->content_length) == false)) {
+					refuse(webserve, fd, 503);
+					LOG(webserve, LOG_WARNING, "REFUSED: Failed to allocate request buffer, %d\n", fd);
+					return READ_ERROR;
+				}
+			}
+
+			value = conversation->known[HEADER_EXPECT].data;
+			value_size = conversation->known[HEADER_EXPECT].size;
+			if ((value != NULL) && (connection->buffer_used == boundary) && (header_has_token(value, value_size, "100-continue")) && ((connection->content_length > 0) || (connection->body_chunked))) {
+				// The client is waiting to hear the body is wanted before sending it
+				if (send(fd, CONTINUE_LINE, sizeof(CONTINUE_LINE) - 1, SEND_FLAGS) < 0) {
+					LOG(webserve, LOG_INFO, "INFO: Failed to send continue, %d\n", fd);
+				}
+			}
+		}
+		else if (connection->buffer_used >= BUFSIZE) {
+			refuse(webserve, fd, 431);
+			LOG(webserve, LOG_WARNING, "REFUSED: Request header too large, %d\n", fd);
+			return READ_ERROR;
+		}
+	}
+
+	if ((connection->parse == PARSE_BODY) && (web_parse_body(webserve, fd, connection) == READ_ERROR)) {
+		return READ_ERROR;
+	}
+
+	if (connection->parse == PARSE_COMPLETE) {
+		webserve->stats.requests++;
+		webserve->stats.requests_by_type[conversation->type]++;
+
+		// Point the conversation into the receive buffer
+		boundary = connection->header_size;
+		conversation->request_header = connection->buffer;
+		conversation->request_header_size = boundary;
+		conversation->request_body = connection->buffer + boundary;
+		conversation->request_body_size = connection->body_end - boundary;
+
+		size = strcspn(connection->buffer, "\r\n");
+		LOG(webserve, LOG_INFO, "Request %d: %.*s\n", hit, size, connection->buffer);
+	}
+
+	return (connection->parse == PARSE_COMPLETE) ? READ_COMPLETE : READ_INCOMPLETE;
+}
+
+READ web_parse_body(Webserve * webserve, int fd, Connection * connection) {
+	char * buffer;
+	size_t raw;
+	size_t end;
+	size_t used;
+	size_t line;
+	size_t take;
+	size_t size;
+	size_t chunk;
+	bool waiting;
+	bool complete;
+	int digit;
+	int code;
+
+	buffer = connection->buffer;
+	raw = connection->body_raw;
+	end = connection->body_end;
+	used = connection->buffer_used;
+	complete = false;
+	code = 0;
+
+	if (connection->body_chunked == false) {
+		// Nothing to decode, just wait for the length given
+		take = connection->content_length - connection->body_received;
+		if (take > used - raw) {
+			take = used - raw;
+		}
+		memmove(buffer + end, buffer + raw, take);
+		raw += take;
+		end += take;
+		connection->body_received += take;
+		complete = (connection->body_received == connection->content_length);
+	}
+	else {
+		// Decode in place, moving the data down over the framing
+		waiting = false;
+		while ((complete == false) && (waiting == false) && (code == 0) && (raw < used)) {
+			switch (connection->chunk) {
+			case CHUNK_DATA:
+				take = (connection->chunk_remaining < used - raw) ? connection->chunk_remaining : used - raw;
+				memmove(buffer + end, buffer + raw, take);
+				raw += take;
+				end += take;
+				connection->body_received += take;
+				connection->chunk_remaining -= take;
+				if (connection->chunk_remaining == 0) {
+					connection->chunk = CHUNK_DATA_END;
+				}
+				break;
+			default:
+				line = raw + scan_find(buffer + raw, used - raw, '\n', '\n');
+				if (line >= used) {
+					waiting = true;
+					if (used - raw > CHUNK_LINE_MAX) {
+						code = 400;
+					}
+				}
+				else if (connection->chunk == CHUNK_SIZE) {
+					// Hex digits, perhaps followed by extensions, which are ignored
+					chunk = 0;
+					for (size = raw; (size < line) && (size - raw < 16) && (isxdigit((unsigned char)buffer[size])); size++) {
+						digit = buffer[size];
+						chunk = (chunk << 4) | ((digit <= '9') ? digit - '0' : (digit | 0x20) - 'a' + 10);
+					}
+					if ((size == raw) || ((buffer[size] != ';') && (buffer[size] != '\r') && (buffer[size] != '\n') && (buffer[size] != ' ') && (buffer[size] != '\t'))) {
+						code = 400;
+					}
+					else if ((webserve->body_callback == NULL) && (chunk > webserve->max_body_size - connection->body_received)) {
+						code = 413;
+					}
+					else {
+						connection->chunk = (chunk > 0) ? CHUNK_DATA : CHUNK_TRAILER;
+						connection->chunk_remaining = chunk;
+					}
+					raw = line + 1;
+				}
+				else if (connection->chunk == CHUNK_DATA_END) {
+					// Only the CRLF may follow the data
+					if ((line > raw + 1) || ((line == raw + 1) && (buffer[raw] != '\r'))) {
+						code = 400;
+					}
+					connection->chunk = CHUNK_SIZE;
+					raw = line + 1;
+				}
+				else {
+					// Trailer fields are skipped, up to the blank line that ends them
+					complete = ((line == raw) || ((line == raw + 1) && (buffer[raw] == '\r')));
+					raw = line + 1;
+				}
+				break;
+			}
+		}
+	}
+
+	if (code != 0) {
+		refuse(webserve, fd, code);
+		LOG(webserve, LOG_WARNING, "REFUSED: Bad chunked request body, %d\n", fd);
+		return READ_ERROR;
+	}
+
+	if ((webserve->body_callback != NULL) && (end > connection->header_size)) {
+		// Hand over what's arrived, then forget it
+		if (webserve->body_callback(&connection->conversation, buffer + connection->header_size, end - connection->header_size) == false) {
+			refuse(webserve, fd, RESPONSE_FORBIDDEN);
+			LOG(webserve, LOG_WARNING, "FORBIDDEN: Request body refused by callback, %d\n", fd);
+			return READ_ERROR;
+		}
+		end = connection->header_size;
+	}
+
+	// Close the gap left by the framing or the callback, so there's room to read into
+	if (raw > end) {
+		memmove(buffer + end, buffer + raw, used - raw);
+		used -= raw - end;
+		raw = end;
+		buffer[used] = 0;
+	}
+	connection->buffer_used = used;
+	connection->body_raw = raw;
+	connection->body_end = end;
+
+	if (complete) {
+		connection->parse = PARSE_COMPLETE;
+		connection->request_end = raw;
+	}
+	else if (used >= connection->buffer_size) {
+		// Full, with more to come, so the buffer has to grow
+		if (webserve->body_callback != NULL) {
+			size = connection->header_size + BUFSIZE;
+		}
+		else {
+			size = connection->buffer_size * 2;
+			if (size > connection->header_size + webserve->max_body_size + CHUNK_LINE_MAX) {
+				size = connection->header_size + webserve->max_body_size + CHUNK_LINE_MAX;
+			}
+		}
+		if (size <= connection->buffer_size) {
+			refuse(webserve, fd, 413);
+			LOG(webserve, LOG_WARNING, "REFUSED: Request body too large, %d\n", fd);
+			return READ_ERROR;
+		}
+		if (request_buffer_grow(webserve, connection, size) == false) {
+			refuse(webserve, fd, 503);
+			LOG(webserve, LOG_WARNING, "REFUSED: Failed to allocate request buffer, %d\n", fd);
+			return READ_ERROR;
+		}
+	}
+
+	return (connection->parse == PARSE_COMPLETE) ? READ_COMPLETE : READ_INCOMPLETE;
+}
+
+void web_parse_request(Connection * connection, size_t boundary) {
+	WebserveConv * conversation;
+	WebserveHeader * header;
+	char const * buffer;
+	char const * query;
+	size_t line;
+	size_t colon;
+	size_t end;
+	size_t value;
+	size_t value_end;
+	unsigned int hash;
+	int known;
+
+	conversation = &connection->conversation;
+	buffer = connection->buffer;
+
+	// Split up the request line using the offsets found while scanning
+	conversation->method.data = buffer;
+	conversation->method.size = (connection->path_start > 0) ? connection->path_start - 1 : 0;
+	conversation->path.data = buffer + connection->path_start;
+	conversation->path.size = (connection->path_end > connection->path_start) ? connection->path_end - connection->path_start : 0;
+	query = memchr(conversation->path.data, '?', conversation->path.size);
+	if (query != NULL) {
+		conversation->query.data = query + 1;
+		conversation->query.size = conversation->path.size - (query + 1 - conversation->path.data);
+		conversation->path.size = query - conversation->path.data;
+	}
+	conversation->version = 9;
+	if ((connection->path_end > 0) && (buffer[connection->path_end] == ' ') && (strncmp(buffer + connection->path_end + 1, "HTTP/", 5) == 0)) {
+		conversation->version = (10 * atoi(buffer + connection->path_end + 6));
+		value = connection->path_end + 7;
+		if ((value < connection->line_end) && (buffer[value] == '.')) {
+			conversation->version += atoi(buffer + value + 1);
+		}
+	}
+
+	// Index each header line, noting the common ones as they go past
+	conversation->headers_num = 0;
+	line = connection->line_end;
+	while (line < boundary) {
+		colon = line + scan_find(buffer + line, boundary - line, ':', '\n');
+		end = colon;
+		if ((colon < boundary) && (buffer[colon] == ':')) {
+			end = colon + scan_find(buffer + colon, boundary - colon, '\n', '\n');
+			value = colon + 1;
+			while ((value < end) && ((buffer[value] == ' ') || (buffer[value] == '\t'))) {
+				value++;
+			}
+			value_end = end;
+			while ((value_end > value) && ((buffer[value_end - 1] == '\r') || (buffer[value_end - 1] == ' ') || (buffer[value_end - 1] == '\t'))) {
+				value_end--;
+			}
+
+			hash = header_hash(buffer + line, colon - line);
+			if (conversation->headers_num < HEADER_INDEX_MAX) {
+				header = &conversation->headers[conversation->headers_num];
+				header->hash = hash;
+				header->name.data = buffer + line;
+				header->name.size = colon - line;
+				header->value.data = buffer + value;
+				header->value.size = value_end - value;
+				conversation->headers_num++;
+			}
+			for (known = 0; known < HEADER_KNOWN_NUM; known++) {
+				if ((known_headers[known].hash == hash) && (strlen(known_headers[known].name) == colon - line) && (strncasecmp(known_headers[known].name, buffer + line, colon - line) == 0)) {
+					if (conversation->known[known].data == NULL) {
+						conversation->known[known].data = buffer + value;
+						conversation->known[known].size = value_end - value;
+					}
+					else if ((known == HEADER_CONTENT_LENGTH) && ((conversation->known[known].size != value_end - value) || (memcmp(conversation->known[known].data, buffer + value, value_end - value) != 0))) {
+						// Lengths that disagree leave nothing to go on, so the
+						// value is emptied and the request refused as malformed
+						conversation->known[known].size = 0;
+					}
+				}
+			}
+		}
+		line = end + 1;
+	}
+}
+
+unsigned int header_hash(char const * name, size_t size) {
+	unsigned int hash;
+	size_t pos;
+	char character;
+
+	// FNV-1a, ignoring case
+	hash = 0x811c9dc5;
+	for (pos = 0; pos < size; pos++) {
+		character = name[pos];
+		if ((character >= 'A') && (character <= 'Z')) {
+			character += 'a' - 'A';
+		}
+		hash = (hash ^ (unsigned char)character) * 0x01000193;
+	}
+
+	return hash;
+}
+
+char const * conv_header(WebserveConv const * conversation, char const * name, size_t * value_size) {
+	WebserveHeader const * header;
+	unsigned int hash;
+	unsigned int index;
+	size_t size;
+
+	size = strlen(name);
+	hash = header_hash(name, size);
+	for (index = 0; index < conversation->headers_num; index++) {
+		header = &conversation->headers[index];
+		if ((header->hash == hash) && (header->name.size == size) && (strncasecmp(header->name.data, name, size) == 0)) {
+			if (value_size != NULL) {
+				*value_size = header->value.size;
+			}
+			return header->value.data;
+		}
+	}
+
+	// Headers that didn't fit in the index can still be found the slow way
+	if (conversation->headers_num >= HEADER_INDEX_MAX) {
+		return header_find(conversation->request_header, conversation->request_header_size, name, value_size);
+	}
+
+	return NULL;
+}
+
+char const * header_find(char const * header, size_t size, char const * name, size_t * value_size) {
+	char const * line;
+	char const * end;
+	char const * value;
+	char const * value_end;
+	size_t namesize;
+	size_t remaining;
+
+	// Look for the named header line, ignoring the request line
+	value = NULL;
+	namesize = strlen(name);
+	end = header + size;
+	line = memchr(header, '\n', size);
+	while ((value == NULL) && (line != NULL) && (line + 2 + namesize < end)) {
+		line++;
+		if ((line[namesize] == ':') && (strncasecmp(line, name, namesize) == 0)) {
+			value = line + namesize + 1;
+			while ((value < end) && ((*value == ' ') || (*value == '\t'))) {
+				value++;
+			}
+			// Bounded explicitly by what's left of the buffer
+			remaining = (value < end) ? (size_t)(end - value) : 0;
+			value_end = memchr(value, '\n', remaining);
+			if (value_end == NULL) {
+				value_end = end;
+			}
+			while ((value_end > value) && ((value_end[-1] == '\r') || (value_end[-1] == ' ') || (value_end[-1] == '\t'))) {
+				value_end--;
+			}
+			if (value_size != NULL) {
+				*value_size = value_end - value;
+			}
+		}
+		else {
+			remaining = (line < end) ? (size_t)(end - line) : 0;
+			line = memchr(line, '\n', remaining);
+		}
+	}
+
+	return value;
+}
+
+bool header_has_token(char const * value, size_t size, char const * token) {
+	size_t tokensize;
+	size_t start;
+	size_t pos;
+	bool found;
+
+	// Values are comma separated lists of case-insensitive tokens
+	found = false;
+	tokensize = strlen(token);
+	start = 0;
+	while ((found == false) && (start < size)) {
+		while ((start < size) && ((value[start] == ' ') || (value[start] == ','))) {
+			start++;
+		}
+		pos = start;
+		while ((pos < size) && (value[pos] != ',') && (value[pos] != ' ')) {
+			pos++;
+		}
+		found = ((pos - start) == tokensize) && (strncasecmp(value + start, token, tokensize) == 0);
+		start = pos;
+	}
+
+	return found;
+}
+
+size_t scan_find(char const * data, size_t size, char first, char second) {
+	// Returns the offset of the first byte matching either character, or size
+#if defined(SCAN_AVX2)
+	if ((size >= 32) && __builtin_cpu_supports("avx2")) {
+		return scan_find_avx2(data, size, first, second);
+	}
+#endif
+#if defined(SCAN_SSE2)
+	return scan_find_sse2(data, size, first, second);
+#elif defined(SCAN_NEON)
+	return scan_find_neon(data, size, first, second);
+#else
+	return scan_find_scalar(data, size, first, second);
+#endif
+}
+
+size_t scan_find_scalar(char const * data, size_t size, char first, char second) {
+	size_t pos;
+
+	pos = 0;
+	while ((pos < size) && (data[pos] != first) && (data[pos] != second)) {
+		pos++;
+	}
+
+	return pos;
+}
+
+#if defined(SCAN_SSE2)
+size_t scan_find_sse2(char const * data, size_t size, char first, char second) {
+	__m128i match_first;
+	__m128i match_second;
+	__m128i chunk;
+	size_t pos;
+	int mask;
+
+	// Compare sixteen bytes at a time, finishing off the tail a byte at a time
+	match_first = _mm_set1_epi8(first);
+	match_second = _mm_set1_epi8(second);
+	for (pos = 0; pos + 16 <= size; pos += 16) {
+		chunk = _mm_loadu_si128((__m128i const *)(data + pos));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, match_first), _mm_cmpeq_epi8(chunk, match_second)));
+		if (mask != 0) {
+			return pos + __builtin_ctz(mask);
+		}
+	}
+
+	return pos + scan_find_scalar(data + pos, size - pos, first, second);
+}
+#endif
+
+#if defined(SCAN_AVX2)
+size_t scan_find_avx2(char const * data, size_t size, char first, char second) {
+	__m256i match_first;
+	__m256i match_second;
+	__m256i chunk;
+	size_t pos;
+	unsigned int mask;
+
+	// As for SSE2, but thirty-two bytes at a time
+	match_first = _mm256_set1_epi8(first);
+	match_second = _mm256_set1_epi8(second);
+	for (pos = 0; pos + 32 <= size; pos += 32) {
+		chunk = _mm256_loadu_si256((__m256i const *)(data + pos));
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, match_first), _mm256_cmpeq_epi8(chunk, match_second)));
+		if (mask != 0) {
+			return pos + __builtin_ctz(mask);
+		}
+	}
+
+	return pos + scan_find_sse2(data + pos, size - pos, first, second);
+}
+#endif
+
+#if defined(SCAN_NEON)
+size_t scan_find_neon(char const * data, size_t size, char first, char second) {
+	uint8x16_t match_first;
+	uint8x16_t match_second;
+	uint8x16_t matched;
+	uint64_t mask;
+	size_t pos;
+
+	// NEON has no movemask; narrowing gives four bits per byte instead
+	match_first = vdupq_n_u8((uint8_t)first);
+	match_second = vdupq_n_u8((uint8_t)second);
+	for (pos = 0; pos + 16 <= size; pos += 16) {
+		matched = vld1q_u8((uint8_t const *)(data + pos));
+		matched = vorrq_u8(vceqq_u8(matched, match_first), vceqq_u8(matched, match_second));
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matched), 4)), 0);
+		if (mask != 0) {
+			return pos + (__builtin_ctzll(mask) >> 2);
+		}
+	}
+
+	return pos + scan_find_scalar(data + pos, size - pos, first, second);
+}
+#endif
+
+void web_prepare(Webserve * webserve, Connection * connection) {
+	size_t length;
+	size_t size;
+	char * content;
+	char * compressed;
+	char const * type;
+	WebserveConv * conversation;
+	WebserveResponse const * prepared;
+	WebserveResponse * variant;
+	ENCODING encoding;
+	bool negotiated;
+	
+	conversation = &connection->conversation;
+	content = RESPONSE_CONTENT;
+	length = RESPONSE_LENGTH;
+	type = RESPONSE_TYPE;
+	connection->file_remaining = 0;
+	prepared = conversation->response_prepared;
+	if ((prepared != NULL) && (webserve->compress_min_size > 0) && (prepared->variants[ENCODING_IDENTITY] != NULL)) {
+		// The compressed copies were made when the response was added, and the
+		// one chosen stays put until the connection has finished with it
+		variant = prepared->variants[encoding_choose(conversation, prepared->encodings)];
+		variant->references++;
+		connection->variant = variant;
+		prepared = variant;
+	}
+	if (prepared != NULL) {
+		// Everything's been done already
+		connection->send[SEND_HEADER].iov_base = prepared->header;
+		connection->send[SEND_HEADER].iov_len = prepared->header_size;
+		content = prepared->body;
+		length = prepared->body_size;
+	}
+	else {
+		if (conversation->response_fd >= 0) {
+			// The body comes from the file rather than memory
+			content = NULL;
+			length = conversation->response_length;
+			connection->file_offset = conversation->response_offset;
+			connection->file_remaining = length;
+		}
+		else if (conversation->response_producer != NULL) {
+			// The length isn't known, so HTTP/1.0 clients get it by the close
+			content = NULL;
+			connection->streaming = true;
+			connection->chunked = (conversation->version >= 11);
+			length = connection->chunked ? LENGTH_CHUNKED : LENGTH_CLOSE;
+			if (connection->chunked == false) {
+				connection->keep_alive = false;
+			}
+		}
+		else if (conversation->response) {
+			content = conversation->response;
+			length = conversation->response_size;
+		}
+		if (conversation->response_type) {
+			type = conversation->response_type;
+		}
+
+		// Only bodies held in memory are compressed, and only if they're large
+		// enough to be worth it and not compressed already
+		negotiated = (content != NULL) && (webserve->compress_min_size > 0) && (length >= webserve->compress_min_size) && encoding_compressible(type);
+		if (negotiated) {
+			encoding = encoding_choose(conversation, ENCODINGS_AVAILABLE);
+			if (encoding != ENCODING_IDENTITY) {
+				compressed = conv_alloc(conversation, length);
+				size = (compressed != NULL) ? encoding_compress(encoding, false, content, length, compressed) : 0;
+				if (size > 0) {
+					webserve->stats.compressions++;
+					content = compressed;
+					length = size;
+				}
+				else {
+					encoding = ENCODING_IDENTITY;
+				}
+			}
+		}
+
+		// Craft a response header; the shared lines and a blank line follow
+		connection->send[SEND_HEADER].iov_base = connection->header;
+		connection->send[SEND_HEADER].iov_len = header_build(connection->header, negotiated ? HEADER_SIZE - ENCODING_LINES_SIZE : HEADER_SIZE, conversation->response_code, length, type);
+		if (negotiated) {
+			connection->send[SEND_HEADER].iov_len = header_encoding(connection->header, connection->send[SEND_HEADER].iov_len, encoding);
+		}
+	}
+
+	// Header and body go out together
+	web_prepare_shared(webserve, connection);
+	connection->send[SEND_BODY].iov_base = content;
+	connection->send[SEND_BODY].iov_len = (content != NULL) ? length : 0;
+	connection->send_num = SEND_BODY + 1;
+	connection->send_pos = 0;
+
+	if (conversation->type == REQUEST_HEAD) {
+		// Same headers as for a GET, but without the body
+		connection->send_num = SEND_BODY;
+		connection->file_remaining = 0;
+		connection->streaming = false;
+	}
+}
+
+void web_prepare_shared(Webserve * webserve, Connection * connection) {
+	connection->send[SEND_DATE].iov_base = webserve->date[webserve->date_current];
+	connection->send[SEND_DATE].iov_len = webserve->date_size;
+	if (connection->keep_alive) {
+		connection->send[SEND_CONNECTION].iov_base = CONNECTION_KEEP_ALIVE;
+		connection->send[SEND_CONNECTION].iov_len = sizeof(CONNECTION_KEEP_ALIVE) - 1;
+	}
+	else {
+		connection->send[SEND_CONNECTION].iov_base = CONNECTION_CLOSE;
+		connection->send[SEND_CONNECTION].iov_len = sizeof(CONNECTION_CLOSE) - 1;
+	}
+}
+
+size_t header_build(char * header, size_t size, int code, size_t length, char const * type) {
+	char digits[24];
+	char const * line;
+	size_t position;
+	size_t part;
+	int index;
+	int count;
+
+	// Assembled from pieces, to avoid the cost of printf formatting
+	if (code == 0) {
+		code = 200;
+	}
+	line = NULL;
+	count = sizeof(status_lines) / sizeof(StatusLine);
+	for (index = 0; (index < count) && (line == NULL); index++) {
+		if (status_lines[index].code == code) {
+			line = status_lines[index].line;
+		}
+	}
+
+	if (line != NULL) {
+		part = strlen(line);
+		memcpy(header, line, part);
+		position = part;
+	}
+	else {
+		memcpy(header, "HTTP/1.1 000 Unknown\r\n", 22);
+		header[9] = '0' + ((code / 100) % 10);
+		header[10] = '0' + ((code / 10) % 10);
+		header[11] = '0' + (code % 10);
+		position = 22;
+	}
+
+	if (length == LENGTH_CHUNKED) {
+		memcpy(header + position, "Transfer-Encoding: chunked\r\n", 28);
+		position += 28;
+	}
+	else if (length != LENGTH_CLOSE) {
+		memcpy(header + position, "Content-Length: ", 16);
+		position += 16;
+		index = sizeof(digits);
+		do {
+			index--;
+			digits[index] = '0' + (length % 10);
+			length /= 10;
+		} while (length > 0);
+		memcpy(header + position, digits + index, sizeof(digits) - index);
+		position += sizeof(digits) - index;
+		memcpy(header + position, "\r\n", 2);
+		position += 2;
+	}
+
+	// The content type is whatever the caller chose, so may need cutting short
+	memcpy(header + position, "Content-Type: ", 14);
+	position += 14;
+	part = strlen(type);
+	if (position + part + 2 > size) {
+		part = size - position - 2;
+	}
+	memcpy(header + position, type, part);
+	position += part;
+	memcpy(header + position, "\r\n", 2);
+	position += 2;
+
+	return position;
+}
+
+WebserveResponse * response_build(int code, char const * type, void const * body, size_t size) {
+	WebserveResponse * response;
+	char header[HEADER_SIZE];
+	size_t header_size;
+	size_t type_size;
+
+	if (type == NULL) {
+		type = RESPONSE_TYPE;
+	}
+	header_size = header_build(header, HEADER_SIZE, code, size, type);
+	type_size = strlen(type) + 1;
+	response = malloc(sizeof(WebserveResponse) + header_size + size + type_size);
+	if (response != NULL) {
+		memset(response, 0, sizeof(WebserveResponse));
+		response->header = response->data;
+		response->header_size = header_size;
+		memcpy(response->header, header, header_size);
+		response->body = response->data + header_size;
+		response->body_size = size;
+		if (size > 0) {
+			memcpy(response->body, body, size);
+		}
+		response->code = code;
+		response->type = response->body + size;
+		memcpy(response->type, type, type_size);
+	}
+
+	return response;
+}
+
+WebserveResponse * response_variant(WebserveResponse const * response, ENCODING encoding, char const * body, size_t size) {
+	WebserveResponse * variant;
+	char header[HEADER_SIZE];
+	size_t header_size;
+	size_t copy;
+
+	header_size = header_build(header, HEADER_SIZE - ENCODING_LINES_SIZE, response->code, size, response->type);
+	header_size = header_encoding(header, header_size, encoding);
+	// The identity variant shares the body of the response it came from
+	copy = (encoding != ENCODING_IDENTITY) ? size : 0;
+	variant = malloc(sizeof(WebserveResponse) + header_size + copy);
+	if (variant != NULL) {
+		memset(variant, 0, sizeof(WebserveResponse));
+		variant->header = variant->data;
+		variant->header_size = header_size;
+		memcpy(variant->header, header, header_size);
+		variant->body = (copy > 0) ? variant->data + header_size : response->body;
+		variant->body_size = size;
+		if (copy > 0) {
+			memcpy(variant->body, body, copy);
+		}
+		variant->code = response->code;
+		variant->type = response->type;
+	}
+
+	return variant;
+}
+
+void response_compress(Webserve * webserve, WebserveResponse * response) {
+	char * compressed;
+	size_t size;
+	int encoding;
+
+	// Copies still being sent are freed once their connections are done
+	for (encoding = 0; encoding < ENCODING_NUM; encoding++) {
+		response_retire(response->variants[encoding]);
+		response->variants[encoding] = NULL;
+	}
+	response->encodings = 0;
+
+	if ((webserve->compress_min_size > 0) && (response->body_size >= webserve->compress_min_size) && encoding_compressible(response->type)) {
+		compressed = malloc(response->body_size);
+		if (compressed != NULL) {
+			response->variants[ENCODING_IDENTITY] = response_variant(response, ENCODING_IDENTITY, response->body, response->body_size);
+			for (encoding = ENCODING_IDENTITY + 1; (encoding < ENCODING_NUM) && (response->variants[ENCODING_IDENTITY] != NULL); encoding++) {
+				size = 0;
+				if (ENCODINGS_AVAILABLE & (1 << encoding)) {
+					size = encoding_compress(encoding, true, response->body, response->body_size, compressed);
+				}
+				if (size > 0) {
+					webserve->stats.compressions++;
+					response->variants[encoding] = response_variant(response, encoding, compressed, size);
+				}
+				if (response->variants[encoding] != NULL) {
+					response->encodings |= (1 << encoding);
+				}
+			}
+			free(compressed);
+		}
+	}
+}
+
+void response_free(WebserveResponse * response) {
+	int encoding;
+
+	for (encoding = 0; encoding < ENCODING_NUM; encoding++) {
+		free(response->variants[encoding]);
+	}
+	free(response);
+}
+
+void response_retire(WebserveResponse * variant) {
+	if (variant != NULL) {
+		variant->retired = true;
+		if (variant->references == 0) {
+			free(variant);
+		}
+	}
+}
+
+void response_release(WebserveResponse * variant) {
+	variant->references--;
+	if ((variant->references == 0) && (variant->retired)) {
+		free(variant);
+	}
+}
+
+ENCODING encoding_choose(WebserveConv const * conversation, unsigned int available) {
+	char const * value;
+	size_t size;
+	size_t start;
+	size_t pos;
+	size_t length;
+	int quality[ENCODING_NUM];
+	int wildcard;
+	int q;
+	int encoding;
+	int best;
+	ENCODING chosen;
+
+	// Anything the client doesn't list is refused, unless "*" says otherwise
+	value = conversation->known[HEADER_ACCEPT_ENCODING].data;
+	size = (value != NULL) ? conversation->known[HEADER_ACCEPT_ENCODING].size : 0;
+	for (encoding = 0; encoding < ENCODING_NUM; encoding++) {
+		quality[encoding] = -1;
+	}
+	wildcard = 0;
+
+	start = 0;
+	while ((available != 0) && (start < size)) {
+		while ((start < size) && ((value[start] == ' ') || (value[start] == '\t') || (value[start] == ','))) {
+			start++;
+		}
+		pos = start;
+		while ((pos < size) && (value[pos] != ',') && (value[pos] != ';') && (value[pos] != ' ') && (value[pos] != '\t')) {
+			pos++;
+		}
+
+		// Qualities are held in thousandths; only q=0 actually matters much
+		q = 1000;
+		while ((pos < size) && (value[pos] != ',')) {
+			if (value[pos] == ';') {
+				pos = encoding_parameter(value, size, pos + 1, &q);
+			}
+			else {
+				pos++;
+			}
+		}
+
+		if ((pos > start) && (value[start] == '*') && ((pos - start == 1) || (value[start + 1] == ';') || (value[start + 1] == ' '))) {
+			wildcard = q;
+		}
+		for (encoding = 0; encoding < ENCODING_NUM; encoding++) {
+			length = strlen(encodings[encoding]);
+			if ((size - start >= length) && (strncasecmp(value + start, encodings[encoding], length) == 0) && ((start + length == size) || (strchr(",; \t", value[start + length]) != NULL))) {
+				quality[encoding] = q;
+			}
+		}
+		start = pos;
+	}
+
+	// The most wanted, with ties going to whichever compresses best
+	chosen = ENCODING_IDENTITY;
+	best = 0;
+	for (encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_NUM; encoding++) {
+		q = (quality[encoding] >= 0) ? quality[encoding] : wildcard;
+		if ((available & (1 << encoding)) && (q > 0) && (q >= best)) {
+			chosen = encoding;
+			best = q;
+		}
+	}
+
+	return chosen;
+}
+
+size_t encoding_parameter(char const * value, size_t size, size_t pos, int * q) {
+	unsigned int digits;
+	int scale;
+	int parsed;
+
+	// Whitespace is allowed either side of the ';' and the '='
+	while ((pos < size) && ((value[pos] == ' ') || (value[pos] == '\t'))) {
+		pos++;
+	}
+	if ((pos < size) && ((value[pos] == 'q') || (value[pos] == 'Q'))) {
+		pos++;
+		while ((pos < size) && ((value[pos] == ' ') || (value[pos] == '\t'))) {
+			pos++;
+		}
+		if ((pos < size) && (value[pos] == '=')) {
+			pos++;
+			while ((pos < size) && ((value[pos] == ' ') || (value[pos] == '\t'))) {
+				pos++;
+			}
+			// A quality is 0 or 1, with up to three decimal places
+			parsed = -1;
+			if ((pos < size) && ((value[pos] == '0') || (value[pos] == '1'))) {
+				parsed = (value[pos] - '0') * 1000;
+				pos++;
+				if ((pos < size) && (value[pos] == '.')) {
+					pos++;
+					for (digits = 0, scale = 100; (pos < size) && (digits < 3) && isdigit((unsigned char)value[pos]); digits++, scale /= 10) {
+						parsed += (value[pos] - '0') * scale;
+						pos++;
+					}
+				}
+				if (parsed > 1000) {
+					parsed = 1000;
+				}
+			}
+			while ((pos < size) && ((value[pos] == ' ') || (value[pos] == '\t'))) {
+				pos++;
+			}
+			// Anything else before the next parameter means it wasn't a quality after all
+			if ((parsed >= 0) && ((pos == size) || (value[pos] == ',') || (value[pos] == ';'))) {
+				*q = parsed;
+			}
+		}
+	}
+
+	// Leave the position at the end of the parameter, whatever it was
+	while ((pos < size) && (value[pos] != ',') && (value[pos] != ';')) {
+		pos++;
+	}
+
+	return pos;
+}
+
+bool encoding_compressible(char const * type) {
+	// Text shrinks well, but most other types are compressed already
+	return (strncasecmp(type, "text/", 5) == 0) || (strcasestr(type, "json") != NULL) || (strcasestr(type, "javascript") != NULL) || (strcasestr(type, "xml") != NULL);
+}
+
+size_t encoding_compress(ENCODING encoding, bool best, void const * data, size_t size, char * out) {
+	size_t compressed;
+#if defined(COMPRESS_ZLIB)
+	z_stream stream;
+#endif
+
+	// The output has room for size bytes, since anything larger isn't worth sending
+	compressed = 0;
+#if defined(COMPRESS_ZLIB)
+	if (((encoding == ENCODING_GZIP) || (encoding == ENCODING_DEFLATE)) && (size <= UINT_MAX)) {
+		memset(&stream, 0, sizeof(stream));
+		// Sixteen more window bits asks for the gzip wrapper in place of zlib's
+		if (deflateInit2(&stream, best ? COMPRESS_ZLIB_LEVEL_BEST : COMPRESS_ZLIB_LEVEL, Z_DEFLATED, (encoding == ENCODING_GZIP) ? MAX_WBITS + 16 : MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+			stream.next_in = (Bytef *)data;
+			stream.avail_in = size;
+			stream.next_out = (Bytef *)out;
+			stream.avail_out = size;
+			if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+				compressed = stream.total_out;
+			}
+			deflateEnd(&stream);
+		}
+	}
+#endif
+#if defined(COMPRESS_BROTLI)
+	if (encoding == ENCODING_BROTLI) {
+		compressed = size;
+		if (BrotliEncoderCompress(best ? COMPRESS_BROTLI_QUALITY_BEST : COMPRESS_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, size, data, &compressed, (uint8_t *)out) == BROTLI_FALSE) {
+			compressed = 0;
+		}
+	}
+#endif
+
+	return (compressed < size) ? compressed : 0;
+}
+
+size_t header_encoding(char * header, size_t position, ENCODING encoding) {
+	size_t part;
+
+	// Caches are told the response varies, whichever encoding was chosen
+	if (encoding != ENCODING_IDENTITY) {
+		memcpy(header + position, "Content-Encoding: ", 18);
+		position += 18;
+		part = strlen(encodings[encoding]);
+		memcpy(header + position, encodings[encoding], part);
+		position += part;
+		memcpy(header + position, "\r\n", 2);
+		position += 2;
+	}
+	memcpy(header + position, "Vary: Accept-Encoding\r\n", 23);
+	position += 23;
+
+	return position;
+}
+
+WebserveResponse * add_response(Webserve * webserve, int code, char const * type, void const * body, size_t size) {
+	WebserveResponse * response;
+
+	response = NULL;
+	if (webserve != NULL) {
+		response = response_build(code, type, body, size);
+		if (response != NULL) {
+			response->next = webserve->responses;
+			webserve->responses = response;
+			response_compress(webserve, response);
+		}
+	}
+
+	return response;
+}
+
+void conv_send_response(WebserveConv * conversation, WebserveResponse const * response) {
+	if (conversation != NULL) {
+		conversation->response_prepared = response;
+	}
+}
+
+void date_update(Webserve * webserve) {
+	time_t now;
+	struct tm parts;
+	char * date;
+	size_t size;
+
+	now = time(NULL);
+	if (now != webserve->date_time) {
+		// Write to the spare copy, then switch over to it
+		date = webserve->date[webserve->date_current ^ 1];
+		gmtime_r(&now, &parts);
+		size = strftime(date, DATE_SIZE, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &parts);
+		size += snprintf(date + size, DATE_SIZE - size, "Server: nweb/%d.0\r\n", VERSION);
+		webserve->date_size = (size < DATE_SIZE) ? size : DATE_SIZE - 1;
+		webserve->date_current ^= 1;
+		webserve->date_time = now;
+	}
+}
+
+WRITE web_write(Webserve * webserve, int fd, Connection * connection) {
+	struct msghdr message;
+	ssize_t written;
+	size_t remaining;
+	size_t sent;
+	WRITE result;
+	bool produced;
+
+	result = WRITE_PENDING;
+	sent = 0;
+	do {
+		// Skip over anything that's already been sent
+		while ((connection->send_pos < connection->send_num) && (connection->send[connection->send_pos].iov_len == 0)) {
+			connection->send_pos++;
+		}
+
+		produced = true;
+		if ((connection->streaming) && (connection->send_pos >= connection->send_num)) {
+			// The last chunk has gone, so there's room for the next one
+			produced = web_produce(webserve, connection);
+		}
+
+		if (produced == false) {
+			LOG(webserve, LOG_ERR, "ERROR: Write stream\n");
+			result = WRITE_ERROR;
+		}
+		else if ((connection->send_pos >= connection->send_num) && (connection->file_remaining == 0)) {
+			result = WRITE_COMPLETE;
+		}
+		else if (connection->send_pos >= connection->send_num) {
+			// Only the file is left, which goes straight from the page cache
+			if (connection->corked == false) {
+				socket_cork(fd, true);
+				connection->corked = true;
+			}
+			written = web_write_file(fd, connection);
+			if (written > 0) {
+				connection->file_remaining -= written;
+				webserve->stats.bytes_out += written;
+				sent += written;
+			}
+			else if ((written < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+				break;
+			}
+			else if ((written == 0) || (errno != EINTR)) {
+				// The file was truncated or couldn't be read
+				LOG(webserve, LOG_ERR, "ERROR: Write file\n");
+				result = WRITE_ERROR;
+			}
+		}
+		else {
+			if ((connection->file_remaining > 0) && (connection->corked == false)) {
+				// Keep the header back so it shares segments with the file
+				socket_cork(fd, true);
+				connection->corked = true;
+			}
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = connection->send + connection->send_pos;
+			message.msg_iovlen = connection->send_num - connection->send_pos;
+			written = sendmsg(fd, &message, SEND_FLAGS);
+
+			if (written >= 0) {
+				webserve->stats.bytes_out += written;
+				sent += written;
+				// Advance the send cursor past what went out
+				while (written > 0) {
+					remaining = connection->send[connection->send_pos].iov_len;
+					if (written >= remaining) {
+						connection->send[connection->send_pos].iov_len = 0;
+						connection->send_pos++;
+						written -= remaining;
+					}
+					else {
+						connection->send[connection->send_pos].iov_base = (char *)connection->send[connection->send_pos].iov_base + written;
+						connection->send[connection->send_pos].iov_len -= written;
+						written = 0;
+					}
+				}
+			}
+			else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				// Hold back the rest until it can all go in as few segments as possible
+				if (connection->corked == false) {
+					socket_cork(fd, true);
+					connection->corked = true;
+				}
+				break;
+			}
+			else if (errno != EINTR) {
+				LOG(webserve, LOG_ERR, "ERROR: Write\n");
+				result = WRITE_ERROR;
+			}
+		}
+		// Long streams and files carry on at the next poll, as the socket is
+		// still writable, once everything else that's ready has been seen to
+	} while ((result == WRITE_PENDING) && (sent < WRITE_BUDGET));
+
+	if ((result == WRITE_COMPLETE) && (connection->corked == true)) {
+		socket_cork(fd, false);
+		connection->corked = false;
+	}
+
+	return result;
+}
+
+bool web_produce(Webserve * webserve, Connection * connection) {
+	WebserveConv * conversation;
+	ssize_t produced;
+	char * data;
+	size_t size;
+	int prefix;
+
+	conversation = &connection->conversation;
+	if (connection->stream == NULL) {
+		connection->stream = buffer_acquire(webserve);
+		if (connection->stream == NULL) {
+			return false;
+		}
+	}
+
+	// The producer writes straight into the chunk, so nothing needs copying
+	data = connection->stream + STREAM_PREFIX;
+	produced = conversation->response_producer(conversation, data, STREAM_CHUNK);
+	if (produced < 0) {
+		return false;
+	}
+
+	size = (produced < STREAM_CHUNK) ? produced : STREAM_CHUNK;
+	if (size == 0) {
+		// A zero length chunk marks the end, unless the close does it for us
+		connection->streaming = false;
+		data = STREAM_END;
+		size = connection->chunked ? sizeof(STREAM_END) - 1 : 0;
+	}
+	else if (connection->chunked) {
+		// Frame the data with its size in hex before and a CRLF after
+		data[size] = '\r';
+		data[size + 1] = '\n';
+		data -= 2;
+		memcpy(data, "\r\n", 2);
+		prefix = 2;
+		produced = size;
+		do {
+			data--;
+			*data = "0123456789abcdef"[produced & 0xf];
+			produced >>= 4;
+			prefix++;
+		} while (produced > 0);
+		size += prefix + 2;
+	}
+
+	connection->send[SEND_BODY].iov_base = data;
+	connection->send[SEND_BODY].iov_len = size;
+	connection->send_pos = SEND_BODY;
+	connection->send_num = SEND_BODY + 1;
+
+	return true;
+}
+
+ssize_t web_write_file(int fd, Connection * connection) {
+	ssize_t written;
+	size_t count;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
+	off_t sent;
+#endif
+
+	count = (connection->file_remaining < FILE_CHUNK) ? connection->file_remaining : FILE_CHUNK;
+	written = -1;
+#if defined(__linux__)
+	written = sendfile(fd, connection->conversation.response_fd, &connection->file_offset, count);
+	if ((written < 0) && ((errno == EINVAL) || (errno == ENOSYS))) {
+		// Not every kind of file can be sent like this
+		written = web_write_mapped(fd, connection, count);
+	}
+#elif defined(__APPLE__)
+	sent = count;
+	written = sendfile(connection->conversation.response_fd, fd, connection->file_offset, &sent, NULL, 0);
+	if ((sent > 0) || (written == 0)) {
+		// Partial sends are reported with EAGAIN but still count
+		connection->file_offset += sent;
+		written = sent;
+	}
+#elif defined(__FreeBSD__) || defined(__DragonFly__)
+	sent = 0;
+	written = sendfile(connection->conversation.response_fd, fd, connection->file_offset, count, NULL, &sent, 0);
+	if ((sent > 0) || (written == 0)) {
+		connection->file_offset += sent;
+		written = sent;
+	}
+#else
+	written = web_write_mapped(fd, connection, count);
+#endif
+
+	return written;
+}
+
+ssize_t web_write_mapped(int fd, Connection * connection, size_t count) {
+	ssize_t written;
+	off_t start;
+	size_t skip;
+	void * mapped;
+
+	// Mappings have to start on a page boundary
+	skip = connection->file_offset % sysconf(_SC_PAGESIZE);
+	start = connection->file_offset - skip;
+
+	written = -1;
+	mapped = mmap(NULL, skip + count, PROT_READ, MAP_SHARED, connection->conversation.response_fd, start);
+	if (mapped != MAP_FAILED) {
+		written = send(fd, (char *)mapped + skip, count, SEND_FLAGS);
+		munmap(mapped, skip + count);
+		if (written > 0) {
+			connection->file_offset += written;
+		}
+	}
+
+	return written;
+}
+
+void socket_nodelay(int fd) {
+	int value;
+
+	value = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+}
+
+void socket_busy_poll(Webserve * webserve, int fd) {
+	int value;
+
+	// Raising the kernel's default needs CAP_NET_ADMIN, so failure isn't fatal
+#if defined(SO_BUSY_POLL)
+	value = (int)webserve->busy_poll_usec;
+	if ((value > 0) && (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) < 0)) {
+		LOG(webserve, LOG_DEBUG, "DEBUG: Unable to busy poll %d\n", fd);
+	}
+#endif
+}
+
+void socket_cork(int fd, bool cork) {
+	int value;
+
+	value = cork ? 1 : 0;
+#if defined(TCP_CORK)
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#elif defined(TCP_NOPUSH)
+	setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &value, sizeof(value));
+#endif
+}
+
+bool set_nonblocking(int fd) {
+	int flags;
+
+	flags = fcntl(fd, F_GETFL, 0);
+
+	return ((flags >= 0) && (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0));
+}
+
+void refuse(Webserve * webserve, int socket_fd, int code) {
+	struct iovec send[SEND_IOV];
+	struct msghdr message;
+	ssize_t written;
+	WebserveResponse const * response;
+	int index;
+
+	response = webserve->refusals[0];
+	for (index = 0; index < REFUSALS_NUM; index++) {
+		if (refusals[index].code == code) {
+			response = webserve->refusals[index];
+		}
+	}
+	if (response == NULL) {
+		return;
+	}
+
+	// The connection is closed straight after, so this is a best effort
+	webserve->stats.forbidden++;
+	date_update(webserve);
+	send[SEND_HEADER].iov_base = response->header;
+	send[SEND_HEADER].iov_len = response->header_size;
+	send[SEND_DATE].iov_base = webserve->date[webserve->date_current];
+	send[SEND_DATE].iov_len = webserve->date_size;
+	send[SEND_CONNECTION].iov_base = CONNECTION_CLOSE;
+	send[SEND_CONNECTION].iov_len = sizeof(CONNECTION_CLOSE) - 1;
+	send[SEND_BODY].iov_base = response->body;
+	send[SEND_BODY].iov_len = response->body_size;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = send;
+	message.msg_iovlen = SEND_IOV;
+	written = sendmsg(socket_fd, &message, SEND_FLAGS);
+	LOG(webserve, LOG_INFO, "INFO: Refused with %d, wrote response size %zd\n", code, written);
+}
+
+void refuse_close(Webserve * webserve, int socket_fd, int code) {
+	char discard[256];
+	int reads;
+
+	// Closing with the request unread would reset the connection, which can
+	// lose the response, so what's arrived is read and dropped first
+	refuse(webserve, socket_fd, code);
+	shutdown(socket_fd, SHUT_WR);
+	for (reads = 0; (reads < 4) && (recv(socket_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0); reads++) {
+	}
+	close(socket_fd);
+}
+
+void set_timeout_usec(Webserve * webserve, unsigned int usec) {
+	if (webserve) {
+		// Microseconds
+		webserve->timeout_usec = usec;
+	}
+}
+
+void set_spin_usec(Webserve * webserve, unsigned int usec) {
+	if (webserve) {
+		// Zero always blocks for as long as there's nothing to do
+		webserve->spin_usec = usec;
+	}
+}
+
+void set_busy_poll_usec(Webserve * webserve, unsigned int usec) {
+	if (webserve) {
+		// Applies to connections accepted from now on
+		webserve->busy_poll_usec = usec;
+	}
+}
+
+void set_keepalive_timeout_usec(Webserve * webserve, unsigned int usec) {
+	if (webserve) {
+		// Microseconds
+		webserve->keepalive_timeout_usec = usec;
+	}
+}
+
+void set_max_body_size(Webserve * webserve, size_t size) {
+	if (webserve) {
+		webserve->max_body_size = size;
+	}
+}
+
+void set_body_callback(Webserve * webserve, WebserveBodyCallback body_callback) {
+	if (webserve) {
+		// Bodies go to the callback as they arrive, rather than being kept
+		webserve->body_callback = body_callback;
+	}
+}
+
+void set_read_timeout_usec(Webserve * webserve, unsigned int usec) {
+	if (webserve) {
+		// Zero lets requests take as long as they like
+		webserve->read_timeout_usec = usec;
+	}
+}
+
+void set_write_timeout_usec(Webserve * webserve, unsigned int usec) {
+	if (webserve) {
+		webserve->write_timeout_usec = usec;
+	}
+}
+
+void set_keepalive_max_requests(Webserve * webserve, unsigned int requests) {
+	if (webserve) {
+		// Zero or one disables persistent connections
+		webserve->keepalive_max_requests = requests;
+	}
+}
+
+void set_listen_backlog(Webserve * webserve, int backlog) {
+	unsigned int index;
+
+	if ((webserve) && (backlog > 0)) {
+		// Listening again on the same socket just changes the queue length
+		webserve->listen_backlog = backlog;
+		for (index = 0; index < webserve->listeners_num; index++) {
+			if (listen(webserve->listeners[index].fd, backlog) < 0) {
+				LOG(webserve, LOG_ERR, "ERROR: System call: listen\n");
+			}
+		}
+	}
+}
+
+void set_accept_budget(Webserve * webserve, unsigned int accepts) {
+	if ((webserve) && (accepts > 0)) {
+		webserve->accept_budget = accepts;
+#if defined(EVENTS_URING)
+		uring_accept_limit(webserve);
+#endif
+	}
+}
+
+Webserve * start_server(int port) {
+	int listenfd;
+	Webserve * webserve;
+
+	webserve = NULL;
+
+	listenfd = start_listening(port, false, LISTEN_BACKLOG);
+
+	// Go in to the main listening loop
+	if (listenfd >= 0) {
+		webserve = check_connect(listenfd);
+		if (webserve == NULL) {
+			close(listenfd);
+		}
+	}
+
+	return webserve;
+}
+
+Webserve * start_server_empty(void) {
+	// Listeners are added afterwards
+	return check_connect(-1);
+}
+
+int start_listening(int port, bool reuseport, int backlog) {
+	struct sockaddr_in serv_addr;
+	WebserveListenOptions options;
+
+	// Setup the network socket
+	if (port < 0 || port > 60000) {
+		LOG(NULL, LOG_ERR, "ERROR: Invalid port number (try 1->60000): %d\n", port);
+		return -1;
+	}
+
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	serv_addr.sin_port = htons(port);
+
+	memset(&options, 0, sizeof(options));
+	options.reuseport = reuseport;
+
+	return listen_socket(NULL, (struct sockaddr *)&serv_addr, sizeof(serv_addr), &options, backlog);
+}
+
+int listen_socket(Webserve * webserve, struct sockaddr const * address, socklen_t size, WebserveListenOptions const * options, int backlog) {
+	int listenfd;
+	int value;
+	bool tcp;
+
+	if ((listenfd = socket(address->sa_family, SOCK_STREAM, 0)) < 0) {
+		LOG(webserve, LOG_ERR, "ERROR: System call socket\n");
+		return -1;
+	}
+	tcp = (address->sa_family == AF_INET) || (address->sa_family == AF_INET6);
+
+	if (tcp) {
+		// Let a restarted server bind while old connections are in TIME_WAIT
+		value = 1;
+		if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0) {
+			LOG(webserve, LOG_WARNING, "WARNING: System call: setsockopt SO_REUSEADDR\n");
+		}
+	}
+
+	if ((options != NULL) && (options->reuseport)) {
+		// Let several servers bind the same port and have the kernel share out connections
+		value = 1;
+#if defined(SO_REUSEPORT)
+		if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) < 0) {
+			LOG(webserve, LOG_ERR, "ERROR: System call: setsockopt SO_REUSEPORT\n");
+			close(listenfd);
+			return -1;
+		}
+#else
+		LOG(webserve, LOG_ERR, "ERROR: SO_REUSEPORT not supported\n");
+		close(listenfd);
+		return -1;
+#endif
+	}
+
+	if (address->sa_family == AF_INET6) {
+		// The default differs between systems, so is always set
+		value = ((options != NULL) && (options->v6only)) ? 1 : 0;
+		if (setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &value, sizeof(value)) < 0) {
+			LOG(webserve, LOG_WARNING, "WARNING: System call: setsockopt IPV6_V6ONLY\n");
+		}
+	}
+
+	// Buffer sizes are inherited by accepted sockets, and have to be set before
+	// listening for the TCP window scale to take account of them
+	if ((options != NULL) && (options->receive_buffer > 0)) {
+		if (setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &options->receive_buffer, sizeof(options->receive_buffer)) < 0) {
+			LOG(webserve, LOG_WARNING, "WARNING: System call: setsockopt SO_RCVBUF\n");
+		}
+	}
+	if ((options != NULL) && (options->send_buffer > 0)) {
+		if (setsockopt(listenfd, SOL_SOCKET, SO_SNDBUF, &options->send_buffer, sizeof(options->send_buffer)) < 0) {
+			LOG(webserve, LOG_WARNING, "WARNING: System call: setsockopt SO_SNDBUF\n");
+		}
+	}
+
+	// Bind to the listening socket
+	if (bind(listenfd, address, size) < 0) {
+		LOG(webserve, LOG_ERR, "ERROR: System call: bind\n");
+		close(listenfd);
+		return -1;
+	}
+
+	if (set_nonblocking(listenfd) == false) {
+		LOG(webserve, LOG_ERR, "ERROR: System call: fcntl\n");
+		close(listenfd);
+		return -1;
+	}
+
+	// Listen for connections
+	if (listen(listenfd, backlog) <0 ) {
+		LOG(webserve, LOG_ERR, "ERROR: System call: listen\n");
+		close(listenfd);
+		return -1;
+	}
+
+	// The TCP options are only hints, so the server carries on without them
+	if (tcp && (options != NULL) && (options->defer_accept_sec > 0)) {
+#if defined(TCP_DEFER_ACCEPT)
+		value = (int)options->defer_accept_sec;
+		if (setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, sizeof(value)) < 0) {
+			LOG(webserve, LOG_WARNING, "WARNING: System call: setsockopt TCP_DEFER_ACCEPT\n");
+		}
+#else
+		LOG(webserve, LOG_WARNING, "WARNING: TCP_DEFER_ACCEPT not supported\n");
+#endif
+	}
+	if (tcp && (options != NULL) && (options->fastopen_queue > 0)) {
+#if defined(TCP_FASTOPEN)
+		value = options->fastopen_queue;
+		if (setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &value, sizeof(value)) < 0) {
+			LOG(webserve, LOG_WARNING, "WARNING: System call: setsockopt TCP_FASTOPEN\n");
+		}
+#else
+		LOG(webserve, LOG_WARNING, "WARNING: TCP_FASTOPEN not supported\n");
+#endif
+	}
+
+	return listenfd;
+}
+
+bool add_listener(Webserve * webserve, char const * address, int port, WebserveListenOptions const * options) {
+	struct sockaddr_in ipv4;
+	struct sockaddr_in6 ipv6;
+	struct sockaddr * bound;
+	socklen_t size;
+	int listenfd;
+	bool result;
+
+	result = false;
+	if ((webserve == NULL) || (port <= 0) || (port > 65535)) {
+		LOG(webserve, LOG_ERR, "ERROR: Invalid port number: %d\n", port);
+		return false;
+	}
+
+	// Either kind of numeric address; no address at all means any IPv6 one
+	memset(&ipv4, 0, sizeof(ipv4));
+	memset(&ipv6, 0, sizeof(ipv6));
+	bound = NULL;
+	size = 0;
+	if ((address == NULL) || (inet_pton(AF_INET6, address, &ipv6.sin6_addr) == 1)) {
+		ipv6.sin6_family = AF_INET6;
+		ipv6.sin6_port = htons(port);
+		bound = (struct sockaddr *)&ipv6;
+		size = sizeof(ipv6);
+	}
+	else if (inet_pton(AF_INET, address, &ipv4.sin_addr) == 1) {
+		ipv4.sin_family = AF_INET;
+		ipv4.sin_port = htons(port);
+		bound = (struct sockaddr *)&ipv4;
+		size = sizeof(ipv4);
+	}
+
+	if (bound == NULL) {
+		LOG(webserve, LOG_ERR, "ERROR: Invalid address: %s\n", address);
+	}
+	else if (webserve->listeners_num >= LISTENERS_MAX) {
+		LOG(webserve, LOG_ERR, "ERROR: Too many listeners\n");
+	}
+	else {
+		listenfd = listen_socket(webserve, bound, size, options, webserve->listen_backlog);
+		if (listenfd >= 0) {
+			result = listener_add(webserve, listenfd, bound->sa_family, NULL);
+			if (result == false) {
+				close(listenfd);
+			}
+		}
+	}
+
+	return result;
+}
+
+bool add_listener_unix(Webserve * webserve, char const * path, WebserveListenOptions const * options) {
+	struct sockaddr_un address;
+	struct stat info;
+	socklen_t size;
+	size_t length;
+	int listenfd;
+	int probe;
+	bool abstract;
+	bool result;
+
+	result = false;
+	length = (path != NULL) ? strlen(path) : 0;
+	if ((webserve == NULL) || (length == 0) || (length >= sizeof(address.sun_path))) {
+		LOG(webserve, LOG_ERR, "ERROR: Invalid socket path\n");
+		return false;
+	}
+	if (webserve->listeners_num >= LISTENERS_MAX) {
+		LOG(webserve, LOG_ERR, "ERROR: Too many listeners\n");
+		return false;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path, length);
+	size = offsetof(struct sockaddr_un, sun_path) + length + 1;
+
+	// A leading '@' names a socket in Linux's abstract namespace, with no file
+	abstract = (path[0] == '@');
+	if (abstract) {
+		address.sun_path[0] = '\0';
+		size--;
+	}
+	else if ((lstat(path, &info) == 0) && S_ISSOCK(info.st_mode)) {
+		// Only take over a socket that nothing is listening on any more
+		probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		if ((probe >= 0) && (connect(probe, (struct sockaddr *)&address, size) < 0) && (errno == ECONNREFUSED)) {
+			unlink(path);
+		}
+		if (probe >= 0) {
+			close(probe);
+		}
+	}
+
+	listenfd = listen_socket(webserve, (struct sockaddr *)&address, size, options, webserve->listen_backlog);
+	if (listenfd >= 0) {
+		result = listener_add(webserve, listenfd, AF_UNIX, abstract ? NULL : path);
+		if (result == false) {
+			close(listenfd);
+			if (abstract == false) {
+				unlink(path);
+			}
+		}
+	}
+
+	return result;
+}
+
+bool listener_add(Webserve * webserve, int fd, int family, char const * path) {
+	Listener * listener;
+	bool result;
+
+	result = false;
+	if (webserve->listeners_num < LISTENERS_MAX) {
+		listener = &webserve->listeners[webserve->listeners_num];
+		listener->fd = fd;
+		listener->family = family;
+		listener->path = (path != NULL) ? strdup(path) : NULL;
+		webserve->listeners_num++;
+		// Accepting may be paused, in which case it starts with the rest
+		if (webserve->accept_paused_until == 0) {
+			events_update(webserve, fd, 0, EVENT_READ);
+		}
+		result = true;
+	}
+
+	return result;
+}
+
+Listener * listener_find(Webserve * webserve, int fd) {
+	Listener * listener;
+	unsigned int index;
+
+	listener = NULL;
+	for (index = 0; (index < webserve->listeners_num) && (listener == NULL); index++) {
+		if (webserve->listeners[index].fd == fd) {
+			listener = &webserve->listeners[index];
+		}
+	}
+
+	return listener;
+}
+
+WebservePool * start_server_pool(int port, unsigned int servers, bool affinity) {
+	WebservePool * pool;
+	unsigned int index;
+	int listenfd;
+
+	pool = NULL;
+	if (servers > 0) {
+		pool = calloc(sizeof(WebservePool), 1);
+		if (pool != NULL) {
+			pool->size = servers;
+			pool->affinity = affinity;
+			pool->workers = calloc(sizeof(PoolWorker), servers);
+			if (pool->workers == NULL) {
+				free(pool);
+				pool = NULL;
+			}
+		}
+
+		// Each server gets its own listening socket and shares nothing with the others
+		for (index = 0; (index < servers) && (pool != NULL); index++) {
+			pool->workers[index].pool = pool;
+			pool->workers[index].index = index;
+			listenfd = start_listening(port, true, LISTEN_BACKLOG);
+			pool->workers[index].webserve = (listenfd >= 0) ? check_connect(listenfd) : NULL;
+			if (pool->workers[index].webserve == NULL) {
+				// A pool short of a server isn't what was asked for
+				if (listenfd >= 0) {
+					close(listenfd);
+				}
+				finish_server_pool(pool);
+				pool = NULL;
+			}
+		}
+	}
+
+	return pool;
+}
+
+unsigned int pool_size(WebservePool * pool) {
+	return (pool != NULL) ? pool->size : 0;
+}
+
+Webserve * pool_server(WebservePool * pool, unsigned int index) {
+	Webserve * webserve;
+
+	webserve = NULL;
+	if ((pool != NULL) && (index < pool->size)) {
+		webserve = pool->workers[index].webserve;
+	}
+
+	return webserve;
+}
+
+bool pool_pin_thread(WebservePool * pool, unsigned int index) {
+	bool result;
+#if defined(__linux__)
+	cpu_set_t cpus;
+	long count;
+
+	// Spread the servers over the available cores
+	count = sysconf(_SC_NPROCESSORS_ONLN);
+	CPU_ZERO(&cpus);
+	CPU_SET((count > 0) ? (index % count) : 0, &cpus);
+	result = (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0);
+#else
+	result = false;
+#endif
+
+	return result;
+}
+
+void * pool_worker(void * data) {
+	PoolWorker * worker;
+
+	worker = (PoolWorker *)data;
+	if (worker->pool->affinity) {
+		if (pool_pin_thread(worker->pool, worker->index) == false) {
+			LOG(worker->webserve, LOG_WARNING, "WARNING: Unable to set affinity for server %u\n", worker->index);
+		}
+	}
+
+	poll_forever(worker->webserve);
+
+	return NULL;
+}
+
+void pool_forever(WebservePool * pool) {
+	unsigned int index;
+
+	if (pool != NULL) {
+		// Run every server on a thread of its own
+		for (index = 0; index < pool->size; index++) {
+			pool->workers[index].started = (pthread_create(&pool->workers[index].thread, NULL, pool_worker, &pool->workers[index]) == 0);
+			if (pool->workers[index].started == false) {
+				LOG(pool->workers[index].webserve, LOG_ERR, "ERROR: Unable to start thread for server %u\n", index);
+			}
+		}
+
+		for (index = 0; index < pool->size; index++) {
+			if (pool->workers[index].started) {
+				pthread_join(pool->workers[index].thread, NULL);
+				pool->workers[index].started = false;
+			}
+		}
+	}
+}
+
+void pool_quit(WebservePool * pool) {
+	unsigned int index;
+
+	if (pool != NULL) {
+		// Each server is woken, rather than left waiting out its poll timeout
+		for (index = 0; index < pool->size; index++) {
+			__atomic_store_n(&pool->workers[index].webserve->quit, true, __ATOMIC_RELAXED);
+			wake_signal(pool->workers[index].webserve);
+		}
+	}
+}
+
+void finish_server_pool(WebservePool * pool) {
+	unsigned int index;
+
+	if (pool != NULL) {
+		for (index = 0; index < pool->size; index++) {
+			finish_server(pool->workers[index].webserve);
+		}
+		free(pool->workers);
+		free(pool);
+	}
+}
+
+void finish_server(Webserve * webserve) {
+	WebserveResponse * response;
+	int index;
+
+	if (webserve == NULL) {
+		return;
+	}
+
+	webserve->quit = true;
+	set_log_async(webserve, 0);
+	set_stats_path(webserve, NULL);
+	routes_finish(webserve->routes);
+	for (index = 0; index < webserve->listeners_num; index++) {
+		if (webserve->accept_paused_until == 0) {
+			events_update(webserve, webserve->listeners[index].fd, EVENT_READ, 0);
+		}
+		close(webserve->listeners[index].fd);
+		if (webserve->listeners[index].path != NULL) {
+			unlink(webserve->listeners[index].path);
+			free(webserve->listeners[index].path);
+		}
+	}
+	webserve->listeners_num = 0;
+	connections_finish(webserve);
+	wake_finish(webserve);
+	cache_finish(webserve);
+	free(webserve->rate.buckets);
+	while (webserve->responses != NULL) {
+		response = webserve->responses;
+		webserve->responses = response->next;
+		response_free(response);
+	}
+	for (index = 0; index < REFUSALS_NUM; index++) {
+		response_free(webserve->refusals[index]);
+	}
+	if (webserve->spare_fd >= 0) {
+		close(webserve->spare_fd);
+	}
+	while (webserve->cache.vary_num > 0) {
+		webserve->cache.vary_num--;
+		free(webserve->cache.vary[webserve->cache.vary_num]);
+	}
+	buffers_finish(webserve);
+	events_finish(webserve);
+	free(webserve);
+}
+
+Webserve * check_connect(int listenfd) {
+	Webserve * webserve;
+	int index;
+
+	webserve = calloc(sizeof(Webserve), 1);
+	if (webserve == NULL) {
+		return NULL;
+	}
+	
+	webserve->hit = 0;
+
+	if (events_init(webserve) == false) {
+		LOG(webserve, LOG_ERR, "ERROR: Event backend initialisation\n");
+		free(webserve);
+		return NULL;
+	}
+	if (listenfd >= 0) {
+		listener_add(webserve, listenfd, AF_INET, NULL);
+	}
+
+	// Microseconds
+	webserve->timeout_usec = 1E6;
+	webserve->keepalive_timeout_usec = KEEPALIVE_TIMEOUT_USEC;
+	webserve->keepalive_max_requests = KEEPALIVE_MAX_REQUESTS;
+	webserve->max_body_size = MAX_BODY_SIZE;
+	webserve->read_timeout_usec = READ_TIMEOUT_USEC;
+	webserve->write_timeout_usec = WRITE_TIMEOUT_USEC;
+	webserve->timers.tick = time_usec() / TIMER_TICK_USEC;
+	webserve->listen_backlog = LISTEN_BACKLOG;
+	webserve->accept_budget = ACCEPT_BUDGET;
+	webserve->log_level = LOG_LEVEL_DEFAULT;
+	
+	// Set the default conversation callback
+	webserve->conversation_callback = default_conv_callback;
+
+	// Everything about the refusals is known up front
+	for (index = 0; index < REFUSALS_NUM; index++) {
+		webserve->refusals[index] = response_build(refusals[index].code, "text/html", refusals[index].text, strlen(refusals[index].text));
+	}
+	date_update(webserve);
+
+	// Held back for when descriptors run out
+	webserve->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	
+	webserve->quit = false;
+
+	// Lets other threads interrupt the poll when they complete a conversation
+	if (wake_init(webserve) == false) {
+		LOG(webserve, LOG_WARNING, "WARNING: Deferred responses will wait for the poll timeout\n");
+	}
+
+	return webserve;
+}
+
+void poll_forever(Webserve * webserve) {
+	// The flag may be set from another thread by pool_quit()
+	while (__atomic_load_n(&webserve->quit, __ATOMIC_RELAXED) != true) {
+		if (poll_once(webserve)) {
+			__atomic_store_n(&webserve->quit, true, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+bool poll_thrice(Webserve * webserve) {
+	int count;
+	for (count = 0; (count < 3) && (webserve->quit != true); count++) {
+		webserve->quit |= poll_once(webserve);
+	}
+
+	return webserve->quit;
+}
+
+bool poll_for(Webserve * webserve, unsigned int budget_usec) {
+	uint64_t end;
+	uint64_t now;
+
+	// Always poll at least once, even if there's no time to wait
+	end = time_usec() + budget_usec;
+	do {
+		now = time_usec();
+		webserve->quit |= poll_events(webserve, (end > now) ? (unsigned int)(end - now) : 0);
+	} while ((webserve->quit != true) && (time_usec() < end));
+
+	return webserve->quit;
+}
+
+bool poll_once(Webserve * webserve) {
+	return poll_events(webserve, UINT_MAX);
+}
+
+bool poll_events(Webserve * webserve, unsigned int limit_usec) {
+	int i;
+	int count;
+	unsigned int accepted;
+	unsigned int timeout;
+	uint64_t start;
+
+	accepted = 0;
+	timeout = timers_timeout(webserve);
+	if (timeout > limit_usec) {
+		timeout = limit_usec;
+	}
+	// Keep checking without blocking for a while after anything happens, so
+	// the next request isn't held up by the thread being woken
+	if ((webserve->spin_usec > 0) && (time_usec() - webserve->active_usec < webserve->spin_usec)) {
+		timeout = 0;
+	}
+	count = events_wait(webserve, timeout);
+	date_update(webserve);
+	if (count < 0) {
+		LOG(webserve, LOG_ERR, "ERROR: Poll\n");
+		webserve->quit = true;
+	}
+	start = time_usec();
+
+	// Service only the sockets that are ready
+	for (i = 0; (i < count) && (__atomic_load_n(&webserve->quit, __ATOMIC_RELAXED) != true); ++i) {
+		accepted += events_dispatch(webserve, webserve->ready[i].fd, webserve->ready[i].events);
+	}
+
+	events_housekeeping(webserve, accepted);
+
+	if (count > 0) {
+		webserve->active_usec = time_usec();
+		histogram_record(&webserve->stats.poll_usec, webserve->active_usec - start);
+	}
+
+	// Now the requests have been dealt with there's time to log
+	if (webserve->log.entries != NULL) {
+		flush_log(webserve);
+	}
+	
+	return __atomic_load_n(&webserve->quit, __ATOMIC_RELAXED);
+}
+
+bool process_events(Webserve * webserve, int fd, int events) {
+	unsigned int accepted;
+	uint64_t start;
+
+	// The same as a poll that found just the one descriptor ready
+	date_update(webserve);
+	start = time_usec();
+	accepted = 0;
+	if ((fd >= 0) && (webserve->quit != true)) {
+		accepted = events_dispatch(webserve, fd, events);
+	}
+	events_housekeeping(webserve, accepted);
+	if (fd >= 0) {
+		histogram_record(&webserve->stats.poll_usec, time_usec() - start);
+	}
+
+	if (webserve->log.entries != NULL) {
+		flush_log(webserve);
+	}
+
+	return webserve->quit;
+}
+
+bool process_timeouts(Webserve * webserve) {
+	return process_events(webserve, -1, 0);
+}
+
+unsigned int get_timeout_usec(Webserve * webserve) {
+	return timers_timeout(webserve);
+}
+
+unsigned int events_dispatch(Webserve * webserve, int fd, int events) {
+	unsigned int accepted;
+	Connection * connection;
+	Listener * listener;
+
+	accepted = 0;
+	if (events & EVENT_READ) {
+		if ((listener = listener_find(webserve, fd)) != NULL) {
+			// Connection requests on a listening socket
+			accepted = accept_connections(webserve, listener);
+		}
+		else if (fd == webserve->wake_read) {
+			// Deferred conversations have been completed
+			wake_drain(webserve);
+		}
+		else if ((connection = conversation_get(webserve, fd)) != NULL) {
+			switch (web_read(webserve, fd, connection)) {
+			case READ_COMPLETE:
+				conversation_process(webserve, connection);
+				break;
+			case READ_CLOSED:
+				conversation_close(webserve, connection);
+				break;
+			case READ_ERROR:
+				conversation_linger(webserve, connection);
+				break;
+			default:
+				// Wait for the rest of the request, but not forever; a header has
+				// to arrive in time, while a body need only keep making progress
+				if ((connection->parse != PARSE_LINGER) && ((connection->timer != TIMER_READ) || (connection->parse == PARSE_BODY))) {
+					timer_set(webserve, connection, TIMER_READ);
+				}
+				break;
+			}
+		}
+	}
+	else if ((events & EVENT_WRITE) && ((connection = conversation_get(webserve, fd)) != NULL)) {
+		// Carry on sending from where the last write stopped
+		switch (web_write(webserve, fd, connection)) {
+		case WRITE_COMPLETE:
+			if (conversation_finish(webserve, connection)) {
+				conversation_process(webserve, connection);
+			}
+			break;
+		case WRITE_ERROR:
+			conversation_close(webserve, connection);
+			break;
+		default:
+			// Progress was made, so the client gets longer
+			timer_set(webserve, connection, TIMER_WRITE);
+			break;
+		}
+	}
+
+	return accepted;
+}
+
+void events_housekeeping(Webserve * webserve, unsigned int accepted) {
+	// Send any responses completed since the last poll
+	if (__atomic_load_n(&webserve->completed, __ATOMIC_RELAXED) != NULL) {
+		completions_process(webserve);
+	}
+
+	// Keep track of how bursty connection requests are
+	webserve->stats.accepts_last_tick = accepted;
+	if (accepted > webserve->stats.accepts_max_tick) {
+		webserve->stats.accepts_max_tick = accepted;
+	}
+	if (accepted > 0) {
+		webserve->stats.accept_ticks++;
+	}
+
+	// Answer the pipelined requests held over from the last round
+	if (webserve->pending != NULL) {
+		pending_process(webserve);
+	}
+
+	// Reclaim connections that have waited too long
+	timers_expire(webserve);
+	if ((webserve->accept_paused_until > 0) && (time_usec() >= webserve->accept_paused_until)) {
+		accept_resume(webserve);
+	}
+}
+
+unsigned int accept_connections(Webserve * webserve, Listener * listener) {
+	int fd;
+	int listenfd;
+	unsigned int accepted;
+	socklen_t size;
+	struct sockaddr_storage clientname;
+	char address[INET6_ADDRSTRLEN];
+	uint8_t key[16];
+	bool tcp;
+	Connection * connection;
+
+	// Drain the backlog, but leave time for the existing connections
+	listenfd = listener->fd;
+	tcp = (listener->family != AF_UNIX);
+	accepted = 0;
+	while (accepted < webserve->accept_budget) {
+		if ((webserve->max_connections > 0) && (webserve->connections.live_num >= webserve->max_connections)) {
+			// Leave the rest in the backlog until a connection closes
+			LOG(webserve, LOG_INFO, "INFO: At the connection limit, pausing accepts\n");
+			accept_pause(webserve);
+			break;
+		}
+		size = sizeof (clientname);
+		fd = listener_accept(webserve, listener, &clientname, &size);
+		if ((fd < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+			// Nothing left waiting
+			break;
+		}
+		if ((fd < 0) && ((errno == EINTR) || (errno == ECONNABORTED))) {
+			// The connection went away before we got to it
+			continue;
+		}
+		if ((fd < 0) && ((errno == EMFILE) || (errno == ENFILE))) {
+			// Free the spare descriptor to turn this client away politely, rather
+			// than leave it, and the rest of the backlog, waiting in vain
+			if (webserve->spare_fd >= 0) {
+				close(webserve->spare_fd);
+				fd = accept(listenfd, NULL, NULL);
+				if (fd >= 0) {
+					refuse_close(webserve, fd, 503);
+				}
+				webserve->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+			}
+			LOG(webserve, LOG_WARNING, "WARNING: Out of file descriptors, pausing accepts\n");
+			accept_pause(webserve);
+			break;
+		}
+		if (fd < 0) {
+			// Try again later, rather than spin on whatever the problem is
+			LOG(webserve, LOG_ERR, "ERROR: Accept\n");
+			accept_pause(webserve);
+			break;
+		}
+		accepted++;
+		webserve->stats.accepts++;
+
+		if (tcp && (webserve->rate.buckets != NULL) && rate_key(&clientname, key) && (rate_admit(webserve, key) == false)) {
+			// Turned away before any memory is spent on the connection
+			webserve->stats.rate_limited++;
+			refuse_close(webserve, fd, 429);
+			continue;
+		}
+
+		// Responses go out in a single write, so there's nothing to gain from Nagle
+		if (tcp) {
+			socket_nodelay(fd);
+			if (webserve->busy_poll_usec > 0) {
+				socket_busy_poll(webserve, fd);
+			}
+		}
+		webserve->hit++;
+		if (clientname.ss_family == AF_INET6) {
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&clientname)->sin6_addr, address, sizeof(address));
+		}
+		else if (clientname.ss_family == AF_INET) {
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&clientname)->sin_addr, address, sizeof(address));
+		}
+		else {
+			strcpy(address, "local");
+		}
+		LOG(webserve, LOG_INFO, "INFO: Request %d connection from %s\n", webserve->hit, address);
+		// Start a conversation
+		connection = conversation_new (webserve, fd);
+		if ((connection == NULL) || (events_update(webserve, fd, 0, EVENT_READ) == false)) {
+			LOG(webserve, LOG_ERR, "ERROR: Unable to track connection, closing %d\n", fd);
+			conversation_clear(webserve, fd);
+			close(fd);
+		}
+		else {
+			connection->interest = EVENT_READ;
+			timer_set(webserve, connection, TIMER_READ);
+		}
+	}
+
+	return accepted;
+}
+
+int listener_accept(Webserve * webserve, Listener * listener, struct sockaddr_storage * client, socklen_t * size) {
+	int fd;
+#if defined(EVENTS_URING)
+	unsigned int index;
+
+	// The ring does the accepting unless another event loop has taken over, but
+	// anything it accepted before then is still handed out first
+	index = (unsigned int)(listener - webserve->listeners);
+	if ((webserve->ring.accepts[index].num > 0) || (webserve->fd_callback == NULL)) {
+		fd = uring_accepted(webserve, index);
+		// The ring doesn't say who connected, so only ask when it matters
+		client->ss_family = AF_UNSPEC;
+		if ((fd >= 0) && (((webserve->rate.buckets != NULL) && (listener->family != AF_UNIX)) || (webserve->log_level >= LOG_INFO))) {
+			if (getpeername(fd, (struct sockaddr *)client, size) < 0) {
+				client->ss_family = AF_UNSPEC;
+			}
+		}
+	}
+	else
+#endif
+	{
+#if defined(__linux__)
+		fd = accept4 (listener->fd, (struct sockaddr *) client, size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		fd = accept (listener->fd, (struct sockaddr *) client, size);
+		if (fd >= 0) {
+			set_nonblocking(fd);
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+#endif
+	}
+
+	return fd;
+}
+
+void accept_pause(Webserve * webserve) {
+	unsigned int index;
+
+	// Descriptors and the connection limit are shared, so every listener stops
+	if (webserve->accept_paused_until == 0) {
+		for (index = 0; index < webserve->listeners_num; index++) {
+			events_update(webserve, webserve->listeners[index].fd, EVENT_READ, 0);
+		}
+		webserve->stats.accept_pauses++;
+	}
+	webserve->accept_paused_until = time_usec() + ACCEPT_BACKOFF_USEC;
+}
+
+void accept_resume(Webserve * webserve) {
+	unsigned int index;
+
+	if (webserve->accept_paused_until > 0) {
+		for (index = 0; index < webserve->listeners_num; index++) {
+			events_update(webserve, webserve->listeners[index].fd, 0, EVENT_READ);
+		}
+		webserve->accept_paused_until = 0;
+	}
+}
+
+void set_max_connections(Webserve * webserve, unsigned int connections) {
+	if (webserve) {
+		// Zero allows as many as there are descriptors for
+		webserve->max_connections = connections;
+#if defined(EVENTS_URING)
+		uring_accept_limit(webserve);
+#endif
+	}
+}
+
+void set_rate_limit(Webserve * webserve, unsigned int per_second, unsigned int burst) {
+	if (webserve) {
+		free(webserve->rate.buckets);
+		webserve->rate.buckets = NULL;
+		if (per_second > 0) {
+			webserve->rate.buckets = calloc(sizeof(RateBucket), RATE_BUCKETS);
+		}
+		webserve->rate.rate = per_second;
+		webserve->rate.burst = (burst > 0) ? burst : per_second;
+	}
+}
+
+bool rate_key(struct sockaddr_storage const * client, uint8_t * address) {
+	bool result;
+
+	result = true;
+	memset(address, 0, 16);
+	if (client->ss_family == AF_INET6) {
+		memcpy(address, &((struct sockaddr_in6 const *)client)->sin6_addr, 8);
+		if (IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 const *)client)->sin6_addr)) {
+			// The same client whether it came in over IPv4 or a dual-stack socket
+			memcpy(address, &((struct sockaddr_in6 const *)client)->sin6_addr, 16);
+		}
+	}
+	else if (client->ss_family == AF_INET) {
+		address[10] = 0xff;
+		address[11] = 0xff;
+		memcpy(address + 12, &((struct sockaddr_in const *)client)->sin_addr, 4);
+	}
+	else {
+		result = false;
+	}
+
+	return result;
+}
+
+bool rate_admit(Webserve * webserve, uint8_t const * address) {
+	RateLimit * limit;
+	RateBucket * bucket;
+	RateBucket * oldest;
+	RateBucket * slot;
+	uint32_t words[4];
+	unsigned int hash;
+	unsigned int probe;
+	uint64_t now;
+	uint64_t capacity;
+	uint64_t elapsed;
+	bool admitted;
+
+	limit = &webserve->rate;
+	now = time_usec();
+	capacity = (uint64_t)limit->burst * RATE_TOKEN;
+	memcpy(words, address, sizeof(words));
+	hash = 0;
+	for (probe = 0; probe < 4; probe++) {
+		hash = (hash ^ words[probe]) * 2654435761u;
+	}
+	hash >>= (32 - RATE_BUCKETS_BITS);
+	bucket = NULL;
+	oldest = &limit->buckets[hash];
+	for (probe = 0; (probe < RATE_PROBES) && (bucket == NULL); probe++) {
+		slot = &limit->buckets[(hash + probe) & (RATE_BUCKETS - 1)];
+		if ((slot->updated != 0) && (memcmp(slot->address, address, sizeof(slot->address)) == 0)) {
+			bucket = slot;
+		}
+		else if (slot->updated < oldest->updated) {
+			oldest = slot;
+		}
+	}
+
+	if (bucket == NULL) {
+		// A client that's been pushed out of the table starts afresh
+		bucket = oldest;
+		memcpy(bucket->address, address, sizeof(bucket->address));
+		bucket->tokens = capacity;
+	}
+	else {
+		// Refill for the time since it was last seen, without overflowing
+		elapsed = now - bucket->updated;
+		if (elapsed > capacity / limit->rate) {
+			bucket->tokens = capacity;
+		}
+		else {
+			bucket->tokens += elapsed * limit->rate;
+			if (bucket->tokens > capacity) {
+				bucket->tokens = capacity;
+			}
+		}
+	}
+	bucket->updated = now;
+
+	admitted = (bucket->tokens >= RATE_TOKEN);
+	if (admitted) {
+		bucket->tokens -= RATE_TOKEN;
+	}
+
+	return admitted;
+}
+
+void set_log_level(Webserve * webserve, int level) {
+	if (webserve) {
+		webserve->log_level = level;
+	}
+}
+
+void set_log_async(Webserve * webserve, unsigned int entries) {
+	unsigned int size;
+
+	if (webserve) {
+		// Anything still in the old ring gets written out first
+		flush_log(webserve);
+		free(webserve->log.entries);
+		memset(&webserve->log, 0, sizeof(LogRing));
+
+		if (entries > 0) {
+			size = 1;
+			while (size < entries) {
+				size <<= 1;
+			}
+			webserve->log.entries = calloc(sizeof(LogEntry), size);
+			if (webserve->log.entries != NULL) {
+				webserve->log.size = size;
+			}
+		}
+	}
+}
+
+void log_write(Webserve * webserve, int level, char const * format, ...) {
+	va_list args;
+	unsigned int head;
+	unsigned int tail;
+	LogEntry * entry;
+
+	va_start(args, format);
+	if ((webserve != NULL) && (webserve->log.entries != NULL)) {
+		// Format straight into the ring, dropping the message if it's full
+		head = __atomic_load_n(&webserve->log.head, __ATOMIC_RELAXED);
+		tail = __atomic_load_n(&webserve->log.tail, __ATOMIC_ACQUIRE);
+		if (head - tail < webserve->log.size) {
+			entry = &webserve->log.entries[head & (webserve->log.size - 1)];
+			entry->level = level;
+			vsnprintf(entry->message, LOG_MESSAGE_SIZE, format, args);
+			__atomic_store_n(&webserve->log.head, head + 1, __ATOMIC_RELEASE);
+		}
+		else {
+			__atomic_add_fetch(&webserve->log.dropped, 1, __ATOMIC_RELAXED);
+		}
+	}
+	else {
+#if defined(_WIN32) || defined(_WIN64)
+		vprintf(format, args);
+#else
+		vsyslog(level, format, args);
+#endif
+	}
+	va_end(args);
+}
+
+void flush_log(Webserve * webserve) {
+	unsigned int head;
+	unsigned int tail;
+	unsigned long dropped;
+	LogEntry * entry;
+
+	// Only one thread gets to flush at a time; the others just carry on
+	if ((webserve != NULL) && (webserve->log.entries != NULL) && (__atomic_exchange_n(&webserve->log.flushing, true, __ATOMIC_ACQUIRE) == false)) {
+		head = __atomic_load_n(&webserve->log.head, __ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&webserve->log.tail, __ATOMIC_RELAXED);
+		while (tail != head) {
+			entry = &webserve->log.entries[tail & (webserve->log.size - 1)];
+#if defined(_WIN32) || defined(_WIN64)
+			printf("%s", entry->message);
+#else
+			syslog(entry->level, "%s", entry->message);
+#endif
+			tail++;
+			__atomic_store_n(&webserve->log.tail, tail, __ATOMIC_RELEASE);
+		}
+
+		dropped = __atomic_exchange_n(&webserve->log.dropped, 0, __ATOMIC_RELAXED);
+		if (dropped > 0) {
+#if defined(_WIN32) || defined(_WIN64)
+			printf("WARNING: %lu log messages dropped\n", dropped);
+#else
+			syslog(LOG_WARNING, "WARNING: %lu log messages dropped\n", dropped);
+#endif
+		}
+		__atomic_store_n(&webserve->log.flushing, false, __ATOMIC_RELEASE);
+	}
+}
+
+void get_stats(Webserve * webserve, WebserveStats * stats) {
+	if ((webserve != NULL) && (stats != NULL)) {
+		*stats = webserve->stats;
+		stats->active_connections = webserve->connections.live_num;
+	}
+}
+
+void set_response_cache(Webserve * webserve, size_t size, unsigned int ttl_usec) {
+	if (webserve != NULL) {
+		if ((size == 0) || (ttl_usec == 0)) {
+			cache_finish(webserve);
+		}
+		else {
+			if (webserve->cache.buckets == NULL) {
+				webserve->cache.buckets = calloc(sizeof(CacheEntry *), CACHE_BUCKETS);
+			}
+			if (webserve->cache.buckets != NULL) {
+				webserve->cache.max_size = size;
+				webserve->cache.ttl_usec = ttl_usec;
+			}
+			// Shrink to fit
+			while ((webserve->cache.size > webserve->cache.max_size) && (webserve->cache.oldest != NULL)) {
+				cache_remove(&webserve->cache, webserve->cache.oldest);
+			}
+		}
+	}
+}
+
+void set_compression(Webserve * webserve, size_t min_size) {
+	WebserveResponse * response;
+
+	if (webserve != NULL) {
+		// The response cache holds whatever was sent, compressed or not
+		while (webserve->cache.oldest != NULL) {
+			cache_remove(&webserve->cache, webserve->cache.oldest);
+		}
+		webserve->compress_min_size = min_size;
+		for (response = webserve->responses; response != NULL; response = response->next) {
+			response_compress(webserve, response);
+		}
+	}
+}
+
+bool add_cache_vary(Webserve * webserve, char const * header) {
+	bool result;
+
+	result = false;
+	if ((webserve != NULL) && (header != NULL) && (webserve->cache.vary_num < CACHE_VARY_MAX)) {
+		// Entries keyed without this header would now be wrong
+		while (webserve->cache.oldest != NULL) {
+			cache_remove(&webserve->cache, webserve->cache.oldest);
+		}
+		webserve->cache.vary[webserve->cache.vary_num] = strdup(header);
+		webserve->cache.vary_num++;
+		result = true;
+	}
+
+	return result;
+}
+
+CacheEntry * cache_lookup(Webserve * webserve, WebserveConv * conversation, char ** key, size_t * key_size) {
+	ResponseCache * cache;
+	CacheEntry * entry;
+	char const * values[CACHE_VARY_MAX];
+	size_t sizes[CACHE_VARY_MAX];
+	char const * host;
+	size_t host_size;
+	unsigned int vary;
+	unsigned int hash;
+	size_t size;
+	char * position;
+	ENCODING encoding;
+
+	// The key is the method, since HEAD may be routed apart from GET, and the
+	// host, so that virtual hosts sharing a path are kept apart; then the
+	// request target, the value of each varying header, and the encoding the
+	// response would be sent with
+	cache = &webserve->cache;
+	host_size = 0;
+	host = conv_header(conversation, "Host", &host_size);
+	size = 1 + host_size + 1 + conversation->path.size + 1 + conversation->query.size;
+	for (vary = 0; vary < cache->vary_num; vary++) {
+		sizes[vary] = 0;
+		values[vary] = conv_header(conversation, cache->vary[vary], &sizes[vary]);
+		size += 1 + sizes[vary];
+	}
+	encoding = ENCODING_IDENTITY;
+	if (webserve->compress_min_size > 0) {
+		encoding = encoding_choose(conversation, ENCODINGS_AVAILABLE);
+		size += 2;
+	}
+	*key = conv_alloc(conversation, size);
+	*key_size = size;
+	if (*key == NULL) {
+		return NULL;
+	}
+	position = *key;
+	*position++ = '0' + conversation->type;
+	if ((host != NULL) && (host_size > 0)) {
+		memcpy(position, host, host_size);
+	}
+	position += host_size;
+	*position++ = '\n';
+	memcpy(position, conversation->path.data, conversation->path.size);
+	position += conversation->path.size;
+	*position++ = '?';
+	// Absent query strings and headers have no data to copy at all
+	if (conversation->query.size > 0) {
+		memcpy(position, conversation->query.data, conversation->query.size);
+	}
+	position += conversation->query.size;
+	for (vary = 0; vary < cache->vary_num; vary++) {
+		*position++ = '\n';
+		if ((values[vary] != NULL) && (sizes[vary] > 0)) {
+			memcpy(position, values[vary], sizes[vary]);
+		}
+		position += sizes[vary];
+	}
+	if (webserve->compress_min_size > 0) {
+		*position++ = '\n';
+		*position++ = '0' + encoding;
+	}
+
+	hash = header_hash(*key, size);
+	for (entry = cache->buckets[hash % CACHE_BUCKETS]; entry != NULL; entry = entry->chain) {
+		if ((entry->hash == hash) && (entry->key_size == size) && (memcmp(entry->key, *key, size) == 0)) {
+			break;
+		}
+	}
+
+	if ((entry != NULL) && (entry->expires <= time_usec())) {
+		cache_remove(cache, entry);
+		entry = NULL;
+	}
+
+	if ((entry != NULL) && (cache->newest != entry)) {
+		// Move to the front of the queue
+		entry->newer->older = entry->older;
+		if (entry->older != NULL) {
+			entry->older->newer = entry->newer;
+		}
+		else {
+			cache->oldest = entry->newer;
+		}
+		entry->newer = NULL;
+		entry->older = cache->newest;
+		cache->newest->newer = entry;
+		cache->newest = entry;
+	}
+
+	return entry;
+}
+
+void cache_store(Webserve * webserve, Connection * connection, char const * key, size_t key_size) {
+	ResponseCache * cache;
+	CacheEntry * entry;
+	CacheEntry * existing;
+	size_t header_size;
+	size_t body_size;
+	size_t size;
+	unsigned int hash;
+
+	// Everything but the connection line is the same for every client
+	cache = &webserve->cache;
+	header_size = connection->send[SEND_HEADER].iov_len;
+	body_size = connection->send[SEND_BODY].iov_len;
+	size = sizeof(CacheEntry) + key_size + header_size + body_size;
+	if (size > cache->max_size) {
+		return;
+	}
+
+	entry = malloc(size);
+	if (entry == NULL) {
+		return;
+	}
+	entry->size = size;
+	entry->references = 0;
+	entry->evicted = false;
+	entry->expires = time_usec() + cache->ttl_usec;
+	entry->key = entry->data;
+	entry->key_size = key_size;
+	memcpy(entry->key, key, key_size);
+	entry->header = entry->key + key_size;
+	entry->header_size = header_size;
+	memcpy(entry->header, connection->send[SEND_HEADER].iov_base, header_size);
+	entry->body = entry->header + header_size;
+	entry->body_size = body_size;
+	if (body_size > 0) {
+		memcpy(entry->body, connection->send[SEND_BODY].iov_base, body_size);
+	}
+
+	// Replace any older copy, such as one stored by another connection meanwhile
+	hash = header_hash(key, key_size);
+	entry->hash = hash;
+	for (existing = cache->buckets[hash % CACHE_BUCKETS]; existing != NULL; existing = existing->chain) {
+		if ((existing->hash == hash) && (existing->key_size == key_size) && (memcmp(existing->key, key, key_size) == 0)) {
+			cache_remove(cache, existing);
+			break;
+		}
+	}
+
+	entry->chain = cache->buckets[hash % CACHE_BUCKETS];
+	cache->buckets[hash % CACHE_BUCKETS] = entry;
+	entry->newer = NULL;
+	entry->older = cache->newest;
+	if (cache->newest != NULL) {
+		cache->newest->newer = entry;
+	}
+	else {
+		cache->oldest = entry;
+	}
+	cache->newest = entry;
+	cache->size += size;
+
+	while ((cache->size > cache->max_size) && (cache->oldest != NULL)) {
+		cache_remove(cache, cache->oldest);
+	}
+}
+
+void cache_send(Webserve * webserve, Connection * connection, CacheEntry * entry) {
+	// The entry stays put until the connection has finished with it
+	entry->references++;
+	connection->cached = entry;
+	connection->file_remaining = 0;
+	connection->send[SEND_HEADER].iov_base = entry->header;
+	connection->send[SEND_HEADER].iov_len = entry->header_size;
+	web_prepare_shared(webserve, connection);
+	connection->send[SEND_BODY].iov_base = entry->body;
+	connection->send[SEND_BODY].iov_len = entry->body_size;
+	connection->send_num = (connection->conversation.type == REQUEST_HEAD) ? SEND_BODY : SEND_BODY + 1;
+	connection->send_pos = 0;
+}
+
+void cache_remove(ResponseCache * cache, CacheEntry * entry) {
+	CacheEntry ** link;
+
+	for (link = &cache->buckets[entry->hash % CACHE_BUCKETS]; (*link != NULL) && (*link != entry); link = &(*link)->chain) {
+	}
+	if (*link != NULL) {
+		*link = entry->chain;
+	}
+	if (entry->newer != NULL) {
+		entry->newer->older = entry->older;
+	}
+	else {
+		cache->newest = entry->older;
+	}
+	if (entry->older != NULL) {
+		entry->older->newer = entry->newer;
+	}
+	else {
+		cache->oldest = entry->newer;
+	}
+	cache->size -= entry->size;
+
+	entry->evicted = true;
+	if (entry->references == 0) {
+		free(entry);
+	}
+}
+
+void cache_release(CacheEntry * entry) {
+	entry->references--;
+	if ((entry->references == 0) && (entry->evicted)) {
+		free(entry);
+	}
+}
+
+void cache_finish(Webserve * webserve) {
+	ResponseCache * cache;
+
+	cache = &webserve->cache;
+	while (cache->oldest != NULL) {
+		cache_remove(cache, cache->oldest);
+	}
+	free(cache->buckets);
+	cache->buckets = NULL;
+	cache->max_size = 0;
+}
+
+void set_stats_path(Webserve * webserve, char const * path) {
+	if (webserve) {
+		free(webserve->stats_path);
+		webserve->stats_path = (path != NULL) ? strdup(path) : NULL;
+	}
+}
+
+void histogram_record(WebserveHistogram * histogram, uint64_t value) {
+	unsigned int index;
+	unsigned int exponent;
+
+	if (value > UINT32_MAX) {
+		value = UINT32_MAX;
+	}
+
+	// Small values are exact, larger ones keep HISTOGRAM_SUB_BITS of precision
+	if (value < (1 << HISTOGRAM_SUB_BITS)) {
+		index = value;
+	}
+	else {
+		exponent = 31 - __builtin_clz((uint32_t)value);
+		index = ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + (value >> (exponent - HISTOGRAM_SUB_BITS)) - (1 << HISTOGRAM_SUB_BITS);
+	}
+
+	histogram->buckets[index]++;
+	histogram->count++;
+	histogram->total += value;
+	if (value > histogram->max) {
+		histogram->max = value;
+	}
+}
+
+unsigned long histogram_percentile(WebserveHistogram const * histogram, double percentile) {
+	unsigned long long target;
+	unsigned long long seen;
+	unsigned int index;
+	unsigned int exponent;
+	unsigned long value;
+
+	value = 0;
+	if ((histogram != NULL) && (histogram->count > 0)) {
+		target = (unsigned long long)((percentile / 100.0) * histogram->count + 0.5);
+		if (target < 1) {
+			target = 1;
+		}
+
+		seen = 0;
+		for (index = 0; (index < HISTOGRAM_BUCKETS) && (seen < target); index++) {
+			seen += histogram->buckets[index];
+		}
+		index--;
+
+		// Report the top of the bucket, which is never more than the largest value seen
+		if (index < (1 << HISTOGRAM_SUB_BITS)) {
+			value = index;
+		}
+		else {
+			exponent = (index >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+			value = ((unsigned long)((index & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1 << HISTOGRAM_SUB_BITS) + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+		}
+		if (value > histogram->max) {
+			value = histogram->max;
+		}
+	}
+
+	return value;
+}
+
+void stats_respond(Webserve * webserve, WebserveConv * conversation) {
+	WebserveStats stats;
+	char * response;
+	int size;
+	int request;
+	int position;
+	WebserveHistogram const * histograms[3];
+	char const * names[3];
+	int histogram;
+
+	get_stats(webserve, &stats);
+	histograms[0] = &stats.callback_usec;
+	names[0] = "callback_usec";
+	histograms[1] = &stats.latency_usec;
+	names[1] = "latency_usec";
+	histograms[2] = &stats.poll_usec;
+	names[2] = "poll_usec";
+
+	size = STATS_SIZE;
+	response = conv_alloc(conversation, size);
+	if (response != NULL) {
+		position = snprintf(response, size, "{\"accepts\":%lu,\"accepts_last_tick\":%u,\"accepts_max_tick\":%u,\"accept_pauses\":%lu,\"rate_limited\":%lu,\"active_connections\":%u,\"requests\":%lu,\"forbidden\":%lu,\"cache_hits\":%lu,\"cache_misses\":%lu,\"compressions\":%lu,\"bytes_in\":%llu,\"bytes_out\":%llu,\"requests_by_type\":{", stats.accepts, stats.accepts_last_tick, stats.accepts_max_tick, stats.accept_pauses, stats.rate_limited, stats.active_connections, stats.requests, stats.forbidden, stats.cache_hits, stats.cache_misses, stats.compressions, stats.bytes_in, stats.bytes_out);
+		for (request = 0; (request < REQUEST_NUM) && (position < size); request++) {
+			position += snprintf(response + position, size - position, "%s\"%s\":%lu", (request > 0) ? "," : "", requests[request], stats.requests_by_type[request]);
+		}
+		for (histogram = 0; (histogram < 3) && (position < size); histogram++) {
+			position += snprintf(response + position, size - position, "},\"%s\":{\"count\":%lu,\"mean\":%llu,\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu", names[histogram], histograms[histogram]->count, (histograms[histogram]->count > 0) ? histograms[histogram]->total / histograms[histogram]->count : 0, histogram_percentile(histograms[histogram], 50.0), histogram_percentile(histograms[histogram], 99.0), histogram_percentile(histograms[histogram], 99.9), histograms[histogram]->max);
+		}
+		if (position < size) {
+			position += snprintf(response + position, size - position, "}}\n");
+		}
+
+		conversation->response = response;
+		conversation->response_size = (position < size) ? position : size - 1;
+		conversation->response_type = "application/json";
+	}
+}
+
+bool request_path_is(Connection * connection, char const * path) {
+	WebserveSlice const * request;
+	size_t size;
+
+	// The parser has already found where the path lies
+	request = &connection->conversation.path;
+	size = strlen(path);
+
+	return (request->size == size) && (memcmp(request->data, path, size) == 0);
+}
+
+void conversation_process(Webserve * webserve, Connection * connection) {
+	bool more;
+	unsigned int turn;
+
+	// Respond to each complete request, including any pipelined behind it
+	turn = 0;
+	do {
+		more = false;
+		if (turn >= REQUESTS_PER_TURN) {
+			// Let the other connections have a go before answering the rest
+			events_update(webserve, connection->fd, connection->interest, 0);
+			connection->interest = 0;
+			timer_cancel(webserve, connection);
+			pending_add(webserve, connection);
+			break;
+		}
+		turn++;
+		conversation_respond(webserve, connection);
+
+		if (connection->deferred) {
+			// Nothing more happens on the connection until the response is ready
+			events_update(webserve, connection->fd, connection->interest, 0);
+			connection->interest = 0;
+			timer_cancel(webserve, connection);
+		}
+		else {
+			more = conversation_send(webserve, connection);
+		}
+	} while (more);
+}
+
+bool conversation_send(Webserve * webserve, Connection * connection) {
+	bool more;
+
+	// Most responses can be sent straight away without waiting for a poll
+	more = false;
+	switch (web_write(webserve, connection->fd, connection)) {
+	case WRITE_COMPLETE:
+		more = conversation_finish(webserve, connection);
+		break;
+	case WRITE_ERROR:
+		conversation_close(webserve, connection);
+		break;
+	default:
+		events_update(webserve, connection->fd, connection->interest, EVENT_WRITE);
+		connection->interest = EVENT_WRITE;
+		timer_set(webserve, connection, TIMER_WRITE);
+		break;
+	}
+
+	return more;
+}
+
+void pending_add(Webserve * webserve, Connection * connection) {
+	if (connection->pending == false) {
+		connection->pending = true;
+		connection->pending_next = NULL;
+		connection->pending_prev = webserve->pending_last;
+		if (webserve->pending_last != NULL) {
+			webserve->pending_last->pending_next = connection;
+		}
+		else {
+			webserve->pending = connection;
+		}
+		webserve->pending_last = connection;
+	}
+}
+
+void pending_remove(Webserve * webserve, Connection * connection) {
+	if (connection->pending) {
+		if (connection->pending_prev != NULL) {
+			connection->pending_prev->pending_next = connection->pending_next;
+		}
+		else {
+			webserve->pending = connection->pending_next;
+		}
+		if (connection->pending_next != NULL) {
+			connection->pending_next->pending_prev = connection->pending_prev;
+		}
+		else {
+			webserve->pending_last = connection->pending_prev;
+		}
+		connection->pending = false;
+		connection->pending_next = NULL;
+		connection->pending_prev = NULL;
+	}
+}
+
+void pending_process(Webserve * webserve) {
+	Connection * last;
+	Connection * connection;
+	bool more;
+
+	// Connections queued again while this runs wait for the next round
+	last = webserve->pending_last;
+	more = (last != NULL);
+	while (more) {
+		connection = webserve->pending;
+		more = (connection != last);
+		pending_remove(webserve, connection);
+		conversation_process(webserve, connection);
+	}
+}
+
+void conversation_resume(Webserve * webserve, Connection * connection) {
+	// Pick up where conversation_respond left off
+	connection->deferred = false;
+	web_prepare(webserve, connection);
+	if (conversation_send(webserve, connection)) {
+		conversation_process(webserve, connection);
+	}
+}
+
+void conv_defer(WebserveConv * conversation) {
+	if (conversation != NULL) {
+		CONNECTION(conversation)->deferred = true;
+	}
+}
+
+void conv_complete(Webserve * webserve, WebserveConv * conversation) {
+	Connection * connection;
+	Connection * head;
+
+	if ((webserve != NULL) && (conversation != NULL)) {
+		// Push on to the completed list, which the polling thread takes in one go
+		connection = CONNECTION(conversation);
+		head = __atomic_load_n(&webserve->completed, __ATOMIC_RELAXED);
+		do {
+			connection->completed_next = head;
+		} while (__atomic_compare_exchange_n(&webserve->completed, &head, connection, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED) == false);
+
+		wake_signal(webserve);
+	}
+}
+
+void wake_signal(Webserve * webserve) {
+	uint64_t value;
+	ssize_t written;
+
+	// Interrupt the poll; if this fails the next poll timeout finds it anyway
+	if (webserve->wake_write >= 0) {
+		value = 1;
+#if defined(__linux__)
+		written = write(webserve->wake_write, &value, sizeof(value));
+#else
+		written = write(webserve->wake_write, &value, 1);
+#endif
+		(void)written;
+	}
+}
+
+bool wake_init(Webserve * webserve) {
+#if !defined(__linux__)
+	int fds[2];
+#endif
+
+	webserve->completed = NULL;
+#if defined(__linux__)
+	webserve->wake_read = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	webserve->wake_write = webserve->wake_read;
+#else
+	webserve->wake_read = -1;
+	webserve->wake_write = -1;
+	if (pipe(fds) == 0) {
+		set_nonblocking(fds[0]);
+		set_nonblocking(fds[1]);
+		webserve->wake_read = fds[0];
+		webserve->wake_write = fds[1];
+	}
+#endif
+	if (webserve->wake_read >= 0) {
+		events_update(webserve, webserve->wake_read, 0, EVENT_READ);
+	}
+
+	return (webserve->wake_read >= 0);
+}
+
+void wake_finish(Webserve * webserve) {
+	if (webserve->wake_read >= 0) {
+		events_update(webserve, webserve->wake_read, EVENT_READ, 0);
+		close(webserve->wake_read);
+	}
+	if ((webserve->wake_write >= 0) && (webserve->wake_write != webserve->wake_read)) {
+		close(webserve->wake_write);
+	}
+	webserve->wake_read = -1;
+	webserve->wake_write = -1;
+}
+
+void wake_drain(Webserve * webserve) {
+	char drain[64];
+
+	// An eventfd is emptied by a single read, a pipe may need several
+	while (read(webserve->wake_read, drain, sizeof(drain)) > 0) {
+	}
+}
+
+void completions_process(Webserve * webserve) {
+	Connection * list;
+	Connection * ordered;
+	Connection * next;
+
+	list = __atomic_exchange_n(&webserve->completed, NULL, __ATOMIC_ACQUIRE);
+
+	// The list comes out newest first, so turn it around
+	ordered = NULL;
+	while (list != NULL) {
+		next = list->completed_next;
+		list->completed_next = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	while (ordered != NULL) {
+		next = ordered->completed_next;
+		ordered->completed_next = NULL;
+		if (ordered->deferred) {
+			conversation_resume(webserve, ordered);
+		}
+		ordered = next;
+	}
+}
+
+void conversation_respond(Webserve * webserve, Connection * connection) {
+	bool conv_result;
+	uint64_t start;
+	WebservConvCallback callback;
+	WebserveConv * conversation;
+	CacheEntry * entry;
+	char * key;
+	size_t key_size;
+	bool reserved;
+
+	conversation = &connection->conversation;
+	key = NULL;
+	key_size = 0;
+	reserved = (webserve->stats_path != NULL) && (request_path_is(connection, webserve->stats_path));
+
+	// Let the client know if this is the last request on the connection
+	if (connection->requests + 1 >= webserve->keepalive_max_requests) {
+		connection->keep_alive = false;
+	}
+
+	if (reserved) {
+		// The reserved path reports on the server itself
+		stats_respond(webserve, conversation);
+	}
+	else if ((webserve->cache.max_size > 0) && ((conversation->type == REQUEST_GET) || (conversation->type == REQUEST_HEAD))) {
+		entry = cache_lookup(webserve, conversation, &key, &key_size);
+		if (entry != NULL) {
+			// Send the stored copy without troubling the callback
+			webserve->stats.cache_hits++;
+			cache_send(webserve, connection, entry);
+			return;
+		}
+		webserve->stats.cache_misses++;
+	}
+
+	if (reserved == false) {
+		// The request is complete
+		start = time_usec();
+		callback = webserve->conversation_callback;
+		if (webserve->routes != NULL) {
+			callback = route_find(webserve->routes, conversation->path.data, conversation->path.size, conversation->type, conversation);
+			if (callback == NULL) {
+				conversation->params_num = 0;
+				callback = webserve->conversation_callback;
+			}
+		}
+		if (callback) {
+			conv_result = callback(conversation);
+		}
+
+		if ((callback == NULL) || (conv_result == false)) {
+			conv_result = default_conv_callback (conversation);
+		}
+		histogram_record(&webserve->stats.callback_usec, time_usec() - start);
+	}
+
+	if (connection->deferred) {
+		// The response will be prepared once the callback's owner completes it
+		return;
+	}
+
+	web_prepare(webserve, connection);
+
+	// Only successful responses are worth keeping
+	if ((key != NULL) && (conversation->no_cache == false) && (conversation->response_fd < 0) && (conversation->response_producer == NULL) && ((conversation->response_code == 0) || (conversation->response_code == 200))) {
+		cache_store(webserve, connection, key, key_size);
+	}
+}
+
+bool conversation_finish(Webserve * webserve, Connection * connection) {
+	int fd;
+	int hit;
+	size_t remaining;
+	bool more;
+	READ parsed;
+
+	fd = connection->fd;
+	hit = connection->conversation.hit;
+	connection->requests++;
+	more = false;
+	histogram_record(&webserve->stats.latency_usec, time_usec() - connection->request_start);
+
+	if ((connection->keep_alive == false) || (__atomic_load_n(&webserve->quit, __ATOMIC_RELAXED) == true)) {
+		// Allow socket to drain before signalling the socket is closed
+		//sleep(1);
+		conversation_close(webserve, connection);
+		LOG(webserve, LOG_INFO, "INFO: Request %d closed\n", hit);
+	}
+	else {
+		// Keep any pipelined requests that arrived after this one
+		remaining = connection->buffer_used - connection->request_end;
+		memmove(connection->buffer, connection->buffer + connection->request_end, remaining);
+		connection->buffer_used = remaining;
+		conversation_reset(webserve, connection);
+		if (remaining == 0) {
+			// Idle connections don't need to hold on to a buffer
+			request_buffer_release(webserve, connection);
+		}
+
+		// Pipelined requests were waiting from the moment this one finished
+		connection->request_start = time_usec();
+		parsed = (remaining > 0) ? web_parse(webserve, fd, connection) : READ_INCOMPLETE;
+		if (parsed == READ_COMPLETE) {
+			// The next request is already waiting
+			more = true;
+		}
+		else if (parsed == READ_ERROR) {
+			conversation_linger(webserve, connection);
+		}
+		else {
+			events_update(webserve, fd, connection->interest, EVENT_READ);
+			connection->interest = EVENT_READ;
+			timer_set(webserve, connection, (remaining > 0) ? TIMER_READ : TIMER_IDLE);
+		}
+	}
+
+	return more;
+}
+
+void conversation_close(Webserve * webserve, Connection * connection) {
+	int fd;
+
+	fd = connection->fd;
+	events_update(webserve, fd, connection->interest, 0);
+	conversation_clear(webserve, fd);
+	close(fd);
+
+	// There's a descriptor free now, so there's no need to wait out the pause
+	if (webserve->accept_paused_until > 0) {
+		accept_resume(webserve);
+	}
+}
+
+void conversation_linger(Webserve * webserve, Connection * connection) {
+	int fd;
+
+	// Closing with the request unread would reset the connection, which can
+	// lose the refusal, so stop sending and read what's left before closing
+	fd = connection->fd;
+	pending_remove(webserve, connection);
+	if (shutdown(fd, SHUT_WR) < 0) {
+		conversation_close(webserve, connection);
+	}
+	else {
+		connection->parse = PARSE_LINGER;
+		connection->discarded = 0;
+		events_update(webserve, fd, connection->interest, EVENT_READ);
+		connection->interest = EVENT_READ;
+		timer_set(webserve, connection, TIMER_LINGER);
+		if (web_linger(webserve, fd, connection) == READ_CLOSED) {
+			conversation_close(webserve, connection);
+		}
+	}
+}
+
+READ web_linger(Webserve * webserve, int fd, Connection * connection) {
+	char discard[LINGER_READ];
+	long ret;
+
+	ret = 1;
+	while (((ret > 0) && (connection->discarded < LINGER_MAX)) || ((ret < 0) && (errno == EINTR))) {
+		ret = read(fd, discard, sizeof(discard));
+		if (ret > 0) {
+			connection->discarded += ret;
+			webserve->stats.bytes_in += ret;
+		}
+	}
+
+	// Finished once the client closes its side, or sends more than is worth waiting for
+	if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) && (connection->discarded < LINGER_MAX)) {
+		return READ_INCOMPLETE;
+	}
+
+	return READ_CLOSED;
+}
+
+void conversation_reset(Webserve * webserve, Connection * connection) {
+	WebserveConv * conversation;
+
+	conversation = &connection->conversation;
+
+	conversation_free_content(conversation);
+	arena_reset(connection);
+	// The header index is only valid up to headers_num, so needn't be cleared
+	memset(conversation, 0, offsetof(WebserveConv, headers));
+
+	// Ready the connection for the next request
+	webserve->hit++;
+	conversation->hit = webserve->hit;
+	conversation->type = RESPONSE_ERROR;
+	conversation->response_fd = -1;
+	connection->parse = PARSE_HEADER;
+	connection->scanned = 0;
+	connection->path_start = 0;
+	connection->path_end = 0;
+	connection->line_end = 0;
+	connection->header_size = 0;
+	connection->content_length = 0;
+	connection->request_end = 0;
+	connection->keep_alive = false;
+	connection->streaming = false;
+	connection->chunked = false;
+	buffer_release(webserve, connection->stream);
+	connection->stream = NULL;
+}
+
+void conversation_free_content(WebserveConv * conversation) {
+	Connection * connection;
+
+	// Let go of any cached response being sent
+	connection = CONNECTION(conversation);
+	if (connection->cached != NULL) {
+		cache_release(connection->cached);
+		connection->cached = NULL;
+	}
+	if (connection->variant != NULL) {
+		response_release(connection->variant);
+		connection->variant = NULL;
+	}
+
+	// Clear the conversation content, unless it came from the arena
+	if ((conversation->response) && (arena_contains(CONNECTION(conversation), conversation->response) == false)) {
+		free(conversation->response);
+	}
+	if (conversation->response_fd >= 0) {
+		close(conversation->response_fd);
+		conversation->response_fd = -1;
+	}
+}
+
+void timer_set(Webserve * webserve, Connection * connection, TIMER timer) {
+	TimerWheel * wheel;
+	unsigned int usec;
+	unsigned int slot;
+
+	timer_cancel(webserve, connection);
+	switch (timer) {
+	case TIMER_READ:
+		usec = webserve->read_timeout_usec;
+		break;
+	case TIMER_IDLE:
+		usec = webserve->keepalive_timeout_usec;
+		break;
+	case TIMER_WRITE:
+		usec = webserve->write_timeout_usec;
+		break;
+	case TIMER_LINGER:
+		usec = LINGER_USEC;
+		break;
+	default:
+		usec = 0;
+		break;
+	}
+
+	if (usec > 0) {
+		// Round up, so a deadline is never reached early
+		wheel = &webserve->timers;
+		connection->timer = timer;
+		connection->timer_tick = (time_usec() + usec + TIMER_TICK_USEC - 1) / TIMER_TICK_USEC;
+		if (connection->timer_tick < wheel->tick) {
+			connection->timer_tick = wheel->tick;
+		}
+		slot = connection->timer_tick % TIMER_SLOTS;
+		connection->timer_prev = NULL;
+		connection->timer_next = wheel->slots[slot];
+		if (wheel->slots[slot] != NULL) {
+			wheel->slots[slot]->timer_prev = connection;
+		}
+		wheel->slots[slot] = connection;
+		wheel->num++;
+	}
+}
+
+void timer_cancel(Webserve * webserve, Connection * connection) {
+	TimerWheel * wheel;
+
+	if (connection->timer != TIMER_NONE) {
+		wheel = &webserve->timers;
+		if (connection->timer_prev != NULL) {
+			connection->timer_prev->timer_next = connection->timer_next;
+		}
+		else {
+			wheel->slots[connection->timer_tick % TIMER_SLOTS] = connection->timer_next;
+		}
+		if (connection->timer_next != NULL) {
+			connection->timer_next->timer_prev = connection->timer_prev;
+		}
+		connection->timer_next = NULL;
+		connection->timer_prev = NULL;
+		connection->timer = TIMER_NONE;
+		wheel->num--;
+	}
+}
+
+void timers_expire(Webserve * webserve) {
+	TimerWheel * wheel;
+	Connection * connection;
+	Connection * next;
+	uint64_t current;
+	unsigned int steps;
+
+	wheel = &webserve->timers;
+	current = time_usec() / TIMER_TICK_USEC;
+
+	// Every slot passed since the last check, but no slot twice
+	for (steps = 0; (wheel->tick <= current) && (steps < TIMER_SLOTS); steps++) {
+		connection = wheel->slots[wheel->tick % TIMER_SLOTS];
+		while (connection != NULL) {
+			// Slots are shared with deadlines further round the wheel
+			next = connection->timer_next;
+			if (connection->timer_tick <= current) {
+				LOG(webserve, LOG_INFO, "INFO: Connection %d timed out %s\n", connection->fd, (connection->timer == TIMER_IDLE) ? "idle" : ((connection->timer == TIMER_READ) ? "reading" : ((connection->timer == TIMER_LINGER) ? "lingering" : "writing")));
+				conversation_close(webserve, connection);
+			}
+			connection = next;
+		}
+		wheel->tick++;
+	}
+	wheel->tick = current + 1;
+}
+
+unsigned int timers_timeout(Webserve * webserve) {
+	TimerWheel * wheel;
+	unsigned int timeout;
+	unsigned int ahead;
+	uint64_t due;
+	uint64_t now;
+
+	// Wake for the first occupied slot, if it comes before the usual timeout
+	wheel = &webserve->timers;
+	timeout = webserve->timeout_usec;
+	if (wheel->num > 0) {
+		for (ahead = 0; ahead < TIMER_SLOTS; ahead++) {
+			if (wheel->slots[(wheel->tick + ahead) % TIMER_SLOTS] != NULL) {
+				now = time_usec();
+				due = (wheel->tick + ahead) * TIMER_TICK_USEC;
+				if (due <= now) {
+					timeout = 0;
+				}
+				else if (due - now < timeout) {
+					timeout = due - now;
+				}
+				break;
+			}
+		}
+	}
+
+	// Or for accepting to start again
+	if (webserve->accept_paused_until > 0) {
+		now = time_usec();
+		if (webserve->accept_paused_until <= now) {
+			timeout = 0;
+		}
+		else if (webserve->accept_paused_until - now < timeout) {
+			timeout = webserve->accept_paused_until - now;
+		}
+	}
+
+	// Requests held over from the last round are answered without waiting
+	if (webserve->pending != NULL) {
+		timeout = 0;
+	}
+
+	return timeout;
+}
+
+void conv_send_file(WebserveConv * conversation, int fd, off_t offset, size_t length) {
+	if (conversation != NULL) {
+		if ((conversation->response_fd >= 0) && (conversation->response_fd != fd)) {
+			close(conversation->response_fd);
+		}
+		conversation->response_fd = fd;
+		conversation->response_offset = offset;
+		conversation->response_length = length;
+	}
+}
+
+void conv_send_stream(WebserveConv * conversation, WebserveProducer producer, void * data) {
+	if (conversation != NULL) {
+		conversation->response_producer = producer;
+		conversation->response_producer_data = data;
+	}
+}
+
+void * conv_alloc(WebserveConv * conversation, size_t size) {
+	Connection * connection;
+	ArenaBlock * block;
+	size_t capacity;
+	void * memory;
+
+	memory = NULL;
+	if (conversation != NULL) {
+		connection = CONNECTION(conversation);
+		size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+
+		// Bump allocate from the current block if there's room
+		block = connection->arena;
+		if ((block == NULL) || (block->size - block->used < size)) {
+			capacity = (size > ARENA_BLOCK - ARENA_HEADER) ? size : ARENA_BLOCK - ARENA_HEADER;
+			block = malloc(ARENA_HEADER + capacity);
+			if (block != NULL) {
+				block->next = connection->arena;
+				block->size = capacity;
+				block->used = 0;
+				connection->arena = block;
+			}
+		}
+
+		if (block != NULL) {
+			memory = (char *)block + ARENA_HEADER + block->used;
+			block->used += size;
+		}
+	}
+
+	return memory;
+}
+
+bool arena_contains(Connection * connection, void const * memory) {
+	ArenaBlock * block;
+	bool found;
+
+	found = false;
+	for (block = connection->arena; (block != NULL) && (found == false); block = block->next) {
+		found = ((char const *)memory >= (char *)block + ARENA_HEADER) && ((char const *)memory < (char *)block + ARENA_HEADER + block->size);
+	}
+
+	return found;
+}
+
+void arena_reset(Connection * connection) {
+	ArenaBlock * block;
+	ArenaBlock * next;
+
+	// Keep the oldest block for the next conversation and free the rest, unless
+	// it was made larger for one big allocation that shouldn't stay pinned
+	block = connection->arena;
+	while ((block != NULL) && (block->next != NULL)) {
+		next = block->next;
+		free(block);
+		block = next;
+	}
+	if ((block != NULL) && (block->size != ARENA_BLOCK - ARENA_HEADER)) {
+		free(block);
+		block = NULL;
+	}
+	if (block != NULL) {
+		block->used = 0;
+	}
+	connection->arena = block;
+}
+
+char * buffer_acquire(Webserve * webserve) {
+	char * buffer;
+
+	buffer = webserve->buffers.free;
+	if (buffer != NULL) {
+		memcpy(&webserve->buffers.free, buffer, sizeof(char *));
+		webserve->buffers.free_num--;
+	}
+	else {
+		buffer = malloc(BUFSIZE + 1);
+	}
+
+	return buffer;
+}
+
+void buffer_release(Webserve * webserve, char * buffer) {
+	if (buffer != NULL) {
+		if (webserve->buffers.free_num < BUFFER_POOL_MAX) {
+			memcpy(buffer, &webserve->buffers.free, sizeof(char *));
+			webserve->buffers.free = buffer;
+			webserve->buffers.free_num++;
+		}
+		else {
+			free(buffer);
+		}
+	}
+}
+
+bool request_buffer_grow(Webserve * webserve, Connection * connection, size_t size) {
+	WebserveConv * conversation;
+	char * buffer;
+
+	// Larger buffers come from the heap, and there's always room for a terminator
+	if (connection->buffer_size > BUFSIZE) {
+		buffer = realloc(connection->buffer, size + 1);
+	}
+	else {
+		buffer = malloc(size + 1);
+		if (buffer != NULL) {
+			memcpy(buffer, connection->buffer, connection->buffer_used + 1);
+			buffer_release(webserve, connection->buffer);
+		}
+	}
+	if (buffer == NULL) {
+		return false;
+	}
+	connection->buffer = buffer;
+	connection->buffer_size = size;
+
+	// The request line and headers are indexed by pointer, so need indexing again
+	if (connection->parse != PARSE_HEADER) {
+		conversation = &connection->conversation;
+		memset(&conversation->query, 0, sizeof(WebserveSlice));
+		memset(conversation->known, 0, sizeof(conversation->known));
+		web_parse_request(connection, connection->header_size);
+	}
+
+	return true;
+}
+
+void request_buffer_release(Webserve * webserve, Connection * connection) {
+	if (connection->buffer != NULL) {
+		if (connection->buffer_size > BUFSIZE) {
+			free(connection->buffer);
+		}
+		else {
+			buffer_release(webserve, connection->buffer);
+		}
+		connection->buffer = NULL;
+		connection->buffer_size = 0;
+	}
+}
+
+void buffers_finish(Webserve * webserve) {
+	char * buffer;
+
+	while (webserve->buffers.free != NULL) {
+		buffer = webserve->buffers.free;
+		memcpy(&webserve->buffers.free, buffer, sizeof(char *));
+		free(buffer);
+	}
+	webserve->buffers.free_num = 0;
+}
+
+uint64_t time_usec() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+Connection * conversation_new (Webserve * webserve, int fd) {
+	ConnectionTable * table;
+	Connection * chunk;
+	Connection ** chunks;
+	Connection ** fds;
+	Connection * connection;
+	ArenaBlock * arena;
+	int size;
+	int i;
+
+	connection = NULL;
+	if ((fd >= 0) && (webserve != NULL)) {
+		table = &webserve->connections;
+
+		// There may be an old lingering conversation, which we must clear
+		conversation_clear(webserve, fd);
+
+		// Grow the descriptor map to cover this fd
+		if (fd >= table->fds_size) {
+			size = (table->fds_size > 0) ? table->fds_size : CONNECTION_FDS_INITIAL;
+			while (size <= fd) {
+				size *= 2;
+			}
+			fds = realloc(table->fds, sizeof(Connection *) * size);
+			if (fds == NULL) {
+				return NULL;
+			}
+			memset(fds + table->fds_size, 0, sizeof(Connection *) * (size - table->fds_size));
+			table->fds = fds;
+			table->fds_size = size;
+		}
+
+		// Add another chunk of slots if the free list has run dry
+		if (table->free == NULL) {
+			chunks = realloc(table->chunks, sizeof(Connection *) * (table->chunks_num + 1));
+			chunk = calloc(sizeof(Connection), CONNECTION_CHUNK);
+			if ((chunks == NULL) || (chunk == NULL)) {
+				if (chunks != NULL) {
+					table->chunks = chunks;
+				}
+				free(chunk);
+				return NULL;
+			}
+			table->chunks = chunks;
+			table->chunks[table->chunks_num] = chunk;
+			table->chunks_num++;
+			for (i = CONNECTION_CHUNK - 1; i >= 0; i--) {
+				chunk[i].next = table->free;
+				table->free = &chunk[i];
+			}
+		}
+
+		// Take a slot from the free list and put it on the live list
+		connection = table->free;
+		table->free = connection->next;
+		arena = connection->arena;
+		memset(connection, 0, sizeof(Connection));
+		connection->arena = arena;
+		connection->fd = fd;
+		connection->next = table->live;
+		if (table->live != NULL) {
+			table->live->prev = connection;
+		}
+		table->live = connection;
+		table->live_num++;
+		table->fds[fd] = connection;
+
+		// Create the new conversation structure
+		connection->conversation.hit = webserve->hit;
+		connection->conversation.type = RESPONSE_ERROR;
+		connection->conversation.response_fd = -1;
+	}
+
+	return connection;
+}
+
+void conversation_clear(Webserve * webserve, int fd) {
+	ConnectionTable * table;
+	Connection * connection;
+
+	connection = conversation_get(webserve, fd);
+	if (connection != NULL) {
+		table = &webserve->connections;
+
+		conversation_free_content(&connection->conversation);
+		arena_reset(connection);
+		timer_cancel(webserve, connection);
+		pending_remove(webserve, connection);
+		request_buffer_release(webserve, connection);
+		buffer_release(webserve, connection->stream);
+
+		// Move the slot from the live list back to the free list
+		if (connection->prev != NULL) {
+			connection->prev->next = connection->next;
+		}
+		else {
+			table->live = connection->next;
+		}
+		if (connection->next != NULL) {
+			connection->next->prev = connection->prev;
+		}
+		table->live_num--;
+		table->fds[fd] = NULL;
+
+		connection->fd = -1;
+		connection->prev = NULL;
+		connection->next = table->free;
+		table->free = connection;
+	}
+}
+
+Connection * conversation_get(Webserve * webserve, int fd) {
+	Connection * connection;
+
+	connection = NULL;
+	if ((fd >= 0) && (webserve != NULL) && (fd < webserve->connections.fds_size)) {
+		connection = webserve->connections.fds[fd];
+	}
+
+	return connection;
+}
+
+void connections_finish(Webserve * webserve) {
+	ConnectionTable * table;
+	unsigned int chunk;
+	int i;
+	int fd;
+
+	table = &webserve->connections;
+
+	// Close any connections that are still live
+	while (table->live != NULL) {
+		fd = table->live->fd;
+		conversation_clear(webserve, fd);
+		close(fd);
+	}
+
+	for (chunk = 0; chunk < table->chunks_num; chunk++) {
+		for (i = 0; i < CONNECTION_CHUNK; i++) {
+			free(table->chunks[chunk][i].arena);
+		}
+		free(table->chunks[chunk]);
+	}
+	free(table->chunks);
+	free(table->fds);
+	memset(table, 0, sizeof(ConnectionTable));
+}
+
+bool add_route(Webserve * webserve, REQUEST method, char const * pattern, WebservConvCallback callback) {
+	RouteNode * node;
+	size_t pos;
+	size_t end;
+	size_t size;
+
+	if ((webserve == NULL) || (pattern == NULL) || (method < 0) || (method > REQUEST_ANY)) {
+		return false;
+	}
+	if (webserve->routes == NULL) {
+		webserve->routes = route_new("", 0);
+	}
+
+	// Walk the pattern, adding a node for each literal run or parameter
+	node = webserve->routes;
+	size = strlen(pattern);
+	pos = 0;
+	while ((pos < size) && (node != NULL)) {
+		if ((pattern[pos] == ':') && (pos > 0) && (pattern[pos - 1] == '/')) {
+			end = pos + strcspn(pattern + pos, "/");
+			if (node->param == NULL) {
+				node->param = route_new("", 0);
+				node->param_name = strndup(pattern + pos + 1, end - pos - 1);
+			}
+			else if ((strlen(node->param_name) != end - pos - 1) || (strncmp(node->param_name, pattern + pos + 1, end - pos - 1) != 0)) {
+				LOG(webserve, LOG_ERR, "ERROR: Route parameter conflicts with an earlier route: %s\n", pattern);
+				return false;
+			}
+			node = node->param;
+			pos = end;
+		}
+		else if ((pattern[pos] == '*') && (pos + 1 == size) && (pos > 0) && (pattern[pos - 1] == '/')) {
+			node->wildcard[method] = callback;
+			return true;
+		}
+		else {
+			// Literal text runs up to the next parameter or wildcard
+			end = pos + 1;
+			while ((end < size) && !((pattern[end - 1] == '/') && ((pattern[end] == ':') || ((pattern[end] == '*') && (end + 1 == size))))) {
+				end++;
+			}
+			node = route_insert(node, pattern + pos, end - pos);
+			pos = end;
+		}
+	}
+	if (node == NULL) {
+		return false;
+	}
+	node->callbacks[method] = callback;
+
+	return true;
+}
+
+RouteNode * route_new(char const * prefix, size_t size) {
+	RouteNode * node;
+
+	node = calloc(sizeof(RouteNode), 1);
+	if (node != NULL) {
+		node->prefix = strndup(prefix, size);
+		node->prefix_size = size;
+	}
+
+	return node;
+}
+
+RouteNode * route_insert(RouteNode * node, char const * literal, size_t size) {
+	RouteNode * child;
+	RouteNode * split;
+	RouteNode ** children;
+	char * firsts;
+	unsigned int index;
+	size_t common;
+
+	while (size > 0) {
+		for (index = 0; (index < node->children_num) && (node->firsts[index] < literal[0]); index++) {
+		}
+
+		if ((index >= node->children_num) || (node->firsts[index] != literal[0])) {
+			// Nothing shares this prefix, so it gets a child of its own
+			child = route_new(literal, size);
+			children = realloc(node->children, sizeof(RouteNode *) * (node->children_num + 1));
+			if (children != NULL) {
+				node->children = children;
+			}
+			firsts = realloc(node->firsts, node->children_num + 1);
+			if (firsts != NULL) {
+				node->firsts = firsts;
+			}
+			if ((child == NULL) || (children == NULL) || (firsts == NULL)) {
+				routes_finish(child);
+				return NULL;
+			}
+			memmove(node->children + index + 1, node->children + index, sizeof(RouteNode *) * (node->children_num - index));
+			memmove(node->firsts + index + 1, node->firsts + index, node->children_num - index);
+			node->children[index] = child;
+			node->firsts[index] = literal[0];
+			node->children_num++;
+			return child;
+		}
+
+		child = node->children[index];
+		common = 0;
+		while ((common < size) && (common < child->prefix_size) && (child->prefix[common] == literal[common])) {
+			common++;
+		}
+		if (common < child->prefix_size) {
+			// Split the child where the two diverge
+			split = route_new(child->prefix, common);
+			children = malloc(sizeof(RouteNode *));
+			firsts = malloc(1);
+			if ((split == NULL) || (children == NULL) || (firsts == NULL)) {
+				routes_finish(split);
+				free(children);
+				free(firsts);
+				return NULL;
+			}
+			memmove(child->prefix, child->prefix + common, child->prefix_size - common + 1);
+			child->prefix_size -= common;
+			children[0] = child;
+			firsts[0] = child->prefix[0];
+			split->children = children;
+			split->firsts = firsts;
+			split->children_num = 1;
+			node->children[index] = split;
+			child = split;
+		}
+		node = child;
+		literal += common;
+		size -= common;
+	}
+
+	return node;
+}
+
+WebservConvCallback route_find(RouteNode * node, char const * path, size_t size, REQUEST method, WebserveConv * conversation) {
+	WebservConvCallback callback;
+	WebserveParam * param;
+	unsigned int index;
+	size_t segment;
+
+	// Literal matches are preferred to parameters, and parameters to wildcards
+	callback = NULL;
+	if ((node->prefix_size <= size) && (memcmp(node->prefix, path, node->prefix_size) == 0)) {
+		path += node->prefix_size;
+		size -= node->prefix_size;
+		if (size == 0) {
+			callback = route_callback(node->callbacks, method);
+		}
+
+		if ((callback == NULL) && (size > 0)) {
+			for (index = 0; (index < node->children_num) && (node->firsts[index] < path[0]); index++) {
+			}
+			if ((index < node->children_num) && (node->firsts[index] == path[0])) {
+				callback = route_find(node->children[index], path, size, method, conversation);
+			}
+		}
+
+		if ((callback == NULL) && (node->param != NULL) && (size > 0) && (path[0] != '/') && (conversation->params_num < ROUTE_PARAMS_MAX)) {
+			segment = 0;
+			while ((segment < size) && (path[segment] != '/')) {
+				segment++;
+			}
+			param = &conversation->params[conversation->params_num];
+			param->name = node->param_name;
+			param->value.data = path;
+			param->value.size = segment;
+			conversation->params_num++;
+			callback = route_find(node->param, path + segment, size - segment, method, conversation);
+			if (callback == NULL) {
+				conversation->params_num--;
+			}
+		}
+
+		if ((callback == NULL) && (conversation->params_num < ROUTE_PARAMS_MAX)) {
+			callback = route_callback(node->wildcard, method);
+			if (callback != NULL) {
+				param = &conversation->params[conversation->params_num];
+				param->name = "*";
+				param->value.data = path;
+				param->value.size = size;
+				conversation->params_num++;
+			}
+		}
+	}
+
+	return callback;
+}
+
+WebservConvCallback route_callback(WebservConvCallback const * callbacks, REQUEST method) {
+	WebservConvCallback callback;
+
+	callback = NULL;
+	if ((method >= 0) && (method < REQUEST_NUM)) {
+		callback = callbacks[method];
+	}
+	// HEAD gets whatever GET would, and web_prepare() leaves out the body
+	if ((callback == NULL) && (method == REQUEST_HEAD)) {
+		callback = callbacks[REQUEST_GET];
+	}
+	if (callback == NULL) {
+		callback = callbacks[REQUEST_ANY];
+	}
+
+	return callback;
+}
+
+void routes_finish(RouteNode * node) {
+	unsigned int index;
+
+	if (node != NULL) {
+		for (index = 0; index < node->children_num; index++) {
+			routes_finish(node->children[index]);
+		}
+		routes_finish(node->param);
+		free(node->children);
+		free(node->firsts);
+		free(node->param_name);
+		free(node->prefix);
+		free(node);
+	}
+}
+
+char const * conv_param(WebserveConv const * conversation, char const * name, size_t * value_size) {
+	unsigned int index;
+
+	for (index = 0; index < conversation->params_num; index++) {
+		if (strcmp(conversation->params[index].name, name) == 0) {
+			if (value_size != NULL) {
+				*value_size = conversation->params[index].value.size;
+			}
+			return conversation->params[index].value.data;
+		}
+	}
+
+	return NULL;
+}
+
+void set_conv_callback(Webserve * webserve, WebservConvCallback conversation_callback) {
+	if (webserve != NULL) {
+		if (conversation_callback != NULL) {
+			webserve->conversation_callback = conversation_callback;
+		}
+		else {
+			webserve->conversation_callback = default_conv_callback;
+		}
+	}
+}
+
+bool default_conv_callback (WebserveConv * conversation) {
+	conversation->response = conv_alloc(conversation, RESPONSE_LENGTH + 1);
+	memcpy(conversation->response, RESPONSE_CONTENT, RESPONSE_LENGTH + 1);
+	conversation->response_size = RESPONSE_LENGTH;
+	return true;
+}
+
+
+bool events_update(Webserve * webserve, int fd, int from, int to) {
+	// Another event loop may be doing the watching
+	if (webserve->fd_callback != NULL) {
+		if (from != to) {
+			webserve->fd_callback(webserve, fd, to, webserve->fd_callback_data);
+		}
+		return true;
+	}
+
+	return backend_update(webserve, fd, from, to);
+}
+
+unsigned int get_fds(Webserve * webserve, WebserveEvent * fds, unsigned int size) {
+	Connection * connection;
+	unsigned int count;
+	unsigned int index;
+
+	// Everything being watched, and what for; the count may exceed the size
+	count = 0;
+	for (index = 0; (index < webserve->listeners_num) && (webserve->accept_paused_until == 0); index++) {
+		if (count < size) {
+			fds[count].fd = webserve->listeners[index].fd;
+			fds[count].events = EVENT_READ;
+		}
+		count++;
+	}
+	if (webserve->wake_read >= 0) {
+		if (count < size) {
+			fds[count].fd = webserve->wake_read;
+			fds[count].events = EVENT_READ;
+		}
+		count++;
+	}
+	for (connection = webserve->connections.live; connection != NULL; connection = connection->next) {
+		if (connection->interest != 0) {
+			if (count < size) {
+				fds[count].fd = connection->fd;
+				fds[count].events = connection->interest;
+			}
+			count++;
+		}
+	}
+
+	return count;
+}
+
+void set_fd_callback(Webserve * webserve, WebserveFdCallback callback, void * data) {
+	WebserveEvent * fds;
+	unsigned int count;
+	unsigned int index;
+#if defined(EVENTS_URING)
+	unsigned int accepted;
+#endif
+
+	if (webserve != NULL) {
+		count = get_fds(webserve, NULL, 0);
+		fds = malloc(sizeof(WebserveEvent) * (count + 1));
+		if (fds != NULL) {
+			count = get_fds(webserve, fds, count);
+
+			// Hand the descriptors over from whoever was watching them before
+			for (index = 0; index < count; index++) {
+				events_update(webserve, fds[index].fd, fds[index].events, 0);
+			}
+			webserve->fd_callback = callback;
+			webserve->fd_callback_data = data;
+#if defined(EVENTS_URING)
+			if (callback != NULL) {
+				uring_accept_settle(webserve);
+			}
+#endif
+			for (index = 0; index < count; index++) {
+				events_update(webserve, fds[index].fd, 0, fds[index].events);
+			}
+#if defined(EVENTS_URING)
+			// Connections the ring accepted before the handover aren't in any
+			// backlog the other loop can see, so they're taken on here
+			for (index = 0; (callback != NULL) && (index < webserve->listeners_num); index++) {
+				accepted = 1;
+				while ((webserve->ring.accepts[index].num > 0) && (accepted > 0)) {
+					accepted = accept_connections(webserve, &webserve->listeners[index]);
+				}
+			}
+#endif
+			free(fds);
+		}
+	}
+}
+
+// Event backends
+
+#if defined(EVENTS_EPOLL)
+
+bool events_init(Webserve * webserve) {
+	webserve->pollfd = epoll_create1(EPOLL_CLOEXEC);
+
+	return (webserve->pollfd >= 0);
+}
+
+void events_finish(Webserve * webserve) {
+	if (webserve->pollfd >= 0) {
+		close(webserve->pollfd);
+		webserve->pollfd = -1;
+	}
+}
+
+bool backend_update(Webserve * webserve, int fd, int from, int to) {
+	struct epoll_event event;
+	int op;
+	int result;
+
+	memset(&event, 0, sizeof(event));
+	event.events = ((to & EVENT_READ) ? EPOLLIN : 0) | ((to & EVENT_WRITE) ? EPOLLOUT : 0);
+	// Keep the interest alongside the fd so errors can be routed to it
+	event.data.u64 = ((uint64_t)to << 32) | (uint32_t)fd;
+
+	if (from == 0) {
+		op = EPOLL_CTL_ADD;
+	}
+	else if (to == 0) {
+		op = EPOLL_CTL_DEL;
+	}
+	else {
+		op = EPOLL_CTL_MOD;
+	}
+
+	result = 0;
+	if (from != to) {
+		result = epoll_ctl(webserve->pollfd, op, fd, &event);
+	}
+
+	return (result == 0);
+}
+
+int events_wait(Webserve * webserve, unsigned int timeout_usec) {
+	int count;
+	int i;
+	uint32_t flags;
+	int interest;
+
+	count = epoll_wait(webserve->pollfd, webserve->backend_events, EVENTS_MAX, (timeout_usec + 999) / 1000);
+
+	for (i = 0; i < count; i++) {
+		flags = webserve->backend_events[i].events;
+		interest = (int)(webserve->backend_events[i].data.u64 >> 32);
+		webserve->ready[i].fd = (int)(webserve->backend_events[i].data.u64 & 0xffffffff);
+		webserve->ready[i].events = ((flags & EPOLLIN) ? EVENT_READ : 0) | ((flags & EPOLLOUT) ? EVENT_WRITE : 0);
+		if (flags & (EPOLLERR | EPOLLHUP)) {
+			webserve->ready[i].events |= interest;
+		}
+	}
 
-#include "threadlessweb.h"
+	return count;
+}
 
-// Defines
+#elif defined(EVENTS_KQUEUE)
 
-#define BUFSIZE 8096
+bool events_init(Webserve * webserve) {
+	webserve->pollfd = kqueue();
 
-#define RESPONSE_CONTENT "Okay\n"
-#define RESPONSE_TYPE "text/html"
-#define RESPONSE_LENGTH sizeof(RESPONSE_CONTENT)
+	return (webserve->pollfd >= 0);
+}
 
-#define FORBIDDEN_TEXT "HTTP/1.1 403 Forbidden\nContent-Length: 185\nConnection: close\nContent-Type: text/html\n\n<html><head>\n<title>403 Forbidden</title>\n</head><body>\n<h1>Forbidden</h1>\nThe requested URL, file type or operation is not allowed on this simple static file webserver.\n</body></html>\n"
-#define FORBIDDEN_TEXT_LENGTH sizeof(FORBIDDEN_TEXT)
+void events_finish(Webserve * webserve) {
+	if (webserve->pollfd >= 0) {
+		close(webserve->pollfd);
+		webserve->pollfd = -1;
+	}
+}
 
-#if defined(_WIN32) || defined(_WIN64)
-#define LOG(level_, ...) printf(__VA_ARGS__);
-#else
-#include <syslog.h>
-#define LOG(level_, ...) syslog((level_), __VA_ARGS__)
-#endif
+bool backend_update(Webserve * webserve, int fd, int from, int to) {
+	struct kevent changes[2];
+	int count;
+	int result;
 
-// Structure definitions
+	count = 0;
+	if ((from & EVENT_READ) != (to & EVENT_READ)) {
+		EV_SET(&changes[count], fd, EVFILT_READ, (to & EVENT_READ) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+		count++;
+	}
+	if ((from & EVENT_WRITE) != (to & EVENT_WRITE)) {
+		EV_SET(&changes[count], fd, EVFILT_WRITE, (to & EVENT_WRITE) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+		count++;
+	}
 
-static char const * const requests[] = {
-	"GET ",
-	"POST "
-};
+	result = 0;
+	if (count > 0) {
+		result = kevent(webserve->pollfd, changes, count, NULL, 0, NULL);
+	}
 
-struct _Webserve {
-	int listenfd;
-	int hit;
-	fd_set active_read_fd_set;
-	fd_set active_write_fd_set;
-	unsigned int timeout_usec;
-	WebservConvCallback conversation_callback;
-	WebserveConv * conversation[FD_SETSIZE];
-	bool quit;
-};
+	return (result == 0);
+}
 
-// Function prototypes
+int events_wait(Webserve * webserve, unsigned int timeout_usec) {
+	struct timespec timeout;
+	int count;
+	int i;
 
-void * receive_request(void * t);
-void spawn_receive(int fd, int hit);
-void forbidden(int socket_fd);
-Webserve * check_connect(int listenfd);
-void web_read(int fd, WebserveConv * conversation);
-void web_write(int fd, WebserveConv * conversation);
-void conversation_new(Webserve * webserve, int fd);
-void conversation_clear(Webserve * webserve, int fd);
-bool default_conv_callback(WebserveConv * request);
+	timeout.tv_sec = timeout_usec / 1000000;
+	timeout.tv_nsec = (timeout_usec % 1000000) * 1000;
 
-// Function definitions
+	count = kevent(webserve->pollfd, NULL, 0, webserve->backend_events, EVENTS_MAX, &timeout);
 
-void web_read(int fd, WebserveConv * conversation) {
-	long i, ret;
-	// Static buffer is zero filled
-	static char buffer[BUFSIZE + 1];
-	int request;
-	REQUEST type;
-	int size;
-	int prefixsize;
-	int hit;
-	int boundary;
-	int retcount;
-	
-	hit = 0;
-	if (conversation) {
-		hit = conversation->hit;
+	for (i = 0; i < count; i++) {
+		webserve->ready[i].fd = (int)webserve->backend_events[i].ident;
+		webserve->ready[i].events = (webserve->backend_events[i].filter == EVFILT_WRITE) ? EVENT_WRITE : EVENT_READ;
 	}
 
-	// Read full Web request in one go
-	ret = read(fd, buffer, BUFSIZE);
-	if (ret == 0 || ret == -1) {	/* read failure stop now */
-		forbidden(fd);
-		LOG(LOG_WARNING, "FORBIDDEN: Failed to read browser request, %d\n", fd);
-		exit(3);
+	return count;
+}
+
+#elif defined(EVENTS_URING)
+
+bool events_init(Webserve * webserve) {
+	struct io_uring_params params;
+	UringRing * ring;
+	bool result;
+
+	ring = &webserve->ring;
+	memset(ring, 0, sizeof(UringRing));
+	memset(&params, 0, sizeof(params));
+	webserve->pollfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+
+	// Waiting with a timeout needs the extended arguments to io_uring_enter
+	result = (webserve->pollfd >= 0) && (params.features & IORING_FEAT_EXT_ARG);
+	if (result) {
+		ring->sq_map_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+		ring->cq_map_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			if (ring->cq_map_size > ring->sq_map_size) {
+				ring->sq_map_size = ring->cq_map_size;
+			}
+			ring->cq_map_size = 0;
+		}
+		ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, webserve->pollfd, IORING_OFF_SQ_RING);
+		ring->cq_map = ring->sq_map;
+		if ((ring->sq_map != MAP_FAILED) && (ring->cq_map_size > 0)) {
+			ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, webserve->pollfd, IORING_OFF_CQ_RING);
+		}
+		ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+		ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, webserve->pollfd, IORING_OFF_SQES);
+		result = (ring->sq_map != MAP_FAILED) && (ring->cq_map != MAP_FAILED) && (ring->sqes != MAP_FAILED);
 	}
 
-	if (ret > 0 && ret < BUFSIZE)	{
-		// Return code is valid chars
-		// Terminate the buffer
-		buffer[ret]=0;
+	if (result) {
+		ring->sq_head = (unsigned int *)((char *)ring->sq_map + params.sq_off.head);
+		ring->sq_tail = (unsigned int *)((char *)ring->sq_map + params.sq_off.tail);
+		ring->sq_array = (unsigned int *)((char *)ring->sq_map + params.sq_off.array);
+		ring->sq_mask = *(unsigned int *)((char *)ring->sq_map + params.sq_off.ring_mask);
+		ring->sq_entries = params.sq_entries;
+		ring->cq_head = (unsigned int *)((char *)ring->cq_map + params.cq_off.head);
+		ring->cq_tail = (unsigned int *)((char *)ring->cq_map + params.cq_off.tail);
+		ring->cq_mask = *(unsigned int *)((char *)ring->cq_map + params.cq_off.ring_mask);
+		ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + params.cq_off.cqes);
 	}
 	else {
-		buffer[0] = 0;
-	}
-	// Find the boundary between header and body
-	boundary = ret;
-	retcount = 0;
-	i = 0;
-	while ((boundary == ret) && (i < ret)) {
-		if ((buffer[i] == '\r') || (buffer[i] == '\n')) {
-			retcount++;
-		}
-		else {
-			if (retcount >= 4) {
-				boundary = i;
-			}
-			else {
-				retcount = 0;
-			}
-		}
-		i++;
+		events_finish(webserve);
 	}
 
-	// Copy to the conversation structure
-	if (conversation) {
-		conversation->request_header = malloc(boundary + 1);
-		if (conversation->request_header) {
-			memcpy(conversation->request_header, buffer, boundary);
-			conversation->request_header[boundary] = '\0';
-			conversation->request_header_size = boundary;
-		}
+	return result;
+}
 
-		conversation->request_body = malloc(ret - boundary + 1);
-		if (conversation->request_body) {
-			memcpy(conversation->request_body, buffer + boundary, ret - boundary);
-			conversation->request_body[ret - boundary] = '\0';
-			conversation->request_body_size = (ret - boundary);
-		}
+void events_finish(Webserve * webserve) {
+	UringRing * ring;
+	UringAccept * accept;
+	unsigned int index;
+	unsigned int pos;
+
+	ring = &webserve->ring;
+	if ((ring->cq_map != NULL) && (ring->cq_map != MAP_FAILED)) {
+		// Pick up any connections accepted since the last wait
+		uring_reap(webserve);
 	}
-	
-	// Remove CF and LF characters
-	for (i = 0; i < ret; i++) {
-		if (buffer[i] == '\r' || buffer[i] == '\n') {
-			buffer[i]='*';
+	for (index = 0; index < LISTENERS_MAX; index++) {
+		// Connections accepted but never taken have nobody else to close them
+		accept = &ring->accepts[index];
+		for (pos = 0; pos < accept->num; pos++) {
+			close(accept->queue[(accept->head + pos) % URING_ACCEPTS]);
 		}
 	}
-	LOG(LOG_INFO, "Request %d: %s\n", hit, buffer);
-
-	// Figure out what sort of request this is (GET, POST?)
-	type = REQUEST_INVALID;
-	prefixsize = 0;
-	for (request = 0; (request < REQUEST_NUM) && (type == REQUEST_INVALID); request++) {
-		size = strlen(requests[request]);
-		if (strncasecmp(buffer, requests[request], size) == 0) {
-			prefixsize = size;
-			type = request;
-		}
+	if ((ring->sqes != NULL) && (ring->sqes != MAP_FAILED)) {
+		munmap(ring->sqes, ring->sqes_size);
 	}
-	
-	if (conversation) {
-		conversation->type = type;
+	if ((ring->cq_map != NULL) && (ring->cq_map != MAP_FAILED) && (ring->cq_map != ring->sq_map)) {
+		munmap(ring->cq_map, ring->cq_map_size);
 	}
-
-	// Not all HTTP operations are supported
-	if ((type <= REQUEST_INVALID) || (type >= REQUEST_NUM)) {
-		forbidden(fd);
-		LOG(LOG_WARNING, "FORBIDDEN: Operation not supported: %s: %d\n", buffer, fd);
-		exit(3);
+	if ((ring->sq_map != NULL) && (ring->sq_map != MAP_FAILED)) {
+		munmap(ring->sq_map, ring->sq_map_size);
 	}
-	// null terminate after the second space to ignore extra stuff
-	for (i = prefixsize; i < BUFSIZE; i++) {
-		if (buffer[i] == ' ') {
-			// String is "GET URL " + lots of other stuff
-			buffer[i] = 0;
-			break;
-		}
+	free(ring->polls);
+	memset(ring, 0, sizeof(UringRing));
+	if (webserve->pollfd >= 0) {
+		close(webserve->pollfd);
+		webserve->pollfd = -1;
 	}
 }
 
-void web_write(int fd, WebserveConv * conversation) {
-	// Static buffer is zero filled
-	static char buffer[BUFSIZE + 1];
-	int written;
-	size_t length;
-	char * content;
-	int hit;
-	
-	content = RESPONSE_CONTENT;
-	length = RESPONSE_LENGTH;
-	if (conversation != NULL) {
-		hit = conversation->hit;
-		if (conversation->response) {
-			content = conversation->response;
-			length = conversation->response_size;
+bool backend_update(Webserve * webserve, int fd, int from, int to) {
+	UringRing * ring;
+	UringPoll * poll;
+	UringPoll * polls;
+	Listener * listener;
+	int size;
+	bool accepting;
+	bool result;
+
+	ring = &webserve->ring;
+	result = (fd >= 0);
+	listener = result ? listener_find(webserve, fd) : NULL;
+	accepting = (listener != NULL);
+	if (accepting) {
+		// Listeners accept on the ring rather than waiting to be readable
+		result = uring_accept_update(webserve, (unsigned int)(listener - webserve->listeners), to);
+	}
+	else if (result && (fd >= ring->polls_size)) {
+		size = (ring->polls_size > 0) ? ring->polls_size : CONNECTION_FDS_INITIAL;
+		while (size <= fd) {
+			size *= 2;
+		}
+		polls = realloc(ring->polls, sizeof(UringPoll) * size);
+		if (polls != NULL) {
+			memset(polls + ring->polls_size, 0, sizeof(UringPoll) * (size - ring->polls_size));
+			ring->polls = polls;
+			ring->polls_size = size;
+		}
+		else {
+			result = false;
 		}
 	}
 
-	// Craft a response (Header + a blank line)
-	sprintf(buffer, "HTTP/1.1 200 OK\nServer: nweb/%d.0\nContent-Length: %ld\nConnection: close\nContent-Type: %s\n\n", VERSION, length, RESPONSE_TYPE);
-	written = write(fd, buffer, strlen(buffer));
-	written = write(fd, content, length);
-
-	if (written < 0) {
-		LOG(LOG_ERR, "ERROR: Write\n");
+	if (result && (accepting == false) && (from != to)) {
+		poll = &ring->polls[fd];
+		if (poll->armed) {
+			// Withdraw the old poll; whatever it completes with now is ignored
+			uring_queue(webserve, IORING_OP_POLL_REMOVE, -1, 0, URING_IGNORE, ((uint64_t)poll->generation << 32) | (uint32_t)fd);
+			poll->armed = false;
+		}
+		poll->generation++;
+		poll->interest = to;
+		result = uring_arm(webserve, fd);
 	}
 
-	// Allow socket to drain before signalling the socket is closed
-	//sleep(1);
-	close(fd);
-	LOG(LOG_INFO, "INFO: Request %d closed\n", hit);
+	return result;
 }
 
-void forbidden(int socket_fd) {
-	int written;
+int events_wait(Webserve * webserve, unsigned int timeout_usec) {
+	UringRing * ring;
+	int count;
+	int i;
 
-	written = write(socket_fd, FORBIDDEN_TEXT, FORBIDDEN_TEXT_LENGTH);
-	LOG(LOG_INFO, "INFO: Forbidden, wrote response size %d\n", written);
-}
+	ring = &webserve->ring;
+	// Polls are one-shot, so those that fired last time and are still wanted go
+	// back on; this keeps the level-triggered behaviour the other backends have
+	for (i = 0; i < ring->fired; i++) {
+		uring_arm(webserve, webserve->ready[i].fd);
+	}
+	ring->fired = 0;
+	for (i = 0; i < LISTENERS_MAX; i++) {
+		uring_accept_arm(webserve, (unsigned int)i);
+	}
 
-void set_timeout_usec(Webserve * webserve, unsigned int usec) {
-	if (webserve) {
-		// Microseconds
-		webserve->timeout_usec = usec;
+	// Listeners with connections already accepted are ready without waiting
+	count = uring_accept_ready(webserve, uring_reap(webserve));
+	if (count == 0) {
+		// Queued changes are submitted by the same call that waits
+		if (uring_enter(webserve, timeout_usec) >= 0) {
+			count = uring_accept_ready(webserve, uring_reap(webserve));
+		}
+		else {
+			count = -1;
+		}
+	}
+	else if (ring->sq_pending > 0) {
+		uring_enter(webserve, 0);
+	}
+	if (count > 0) {
+		ring->fired = count;
 	}
-}
 
-Webserve * start_server(int port) {
-	int listenfd;
-	// static = initialised to zeros
-	static struct sockaddr_in serv_addr;
-	Webserve * webserve;
+	return count;
+}
 
-	webserve = NULL;
+bool uring_queue(Webserve * webserve, int opcode, int fd, unsigned int events, uint64_t user_data, uint64_t addr) {
+	UringRing * ring;
+	struct io_uring_sqe * sqe;
+	unsigned int tail;
+	unsigned int index;
+	bool result;
 
-	// Setup the network socket
-	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		LOG(LOG_ERR, "ERROR: System call socket\n");
-		exit(3);
+	ring = &webserve->ring;
+	tail = *ring->sq_tail;
+	if ((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= ring->sq_entries) {
+		// Full, so hand over what's queued so far to make space
+		uring_enter(webserve, 0);
 	}
 
-	if (port < 0 || port > 60000) {
-		LOG(LOG_ERR, "ERROR: Invalid port number (try 1->60000): %d\n", port);
-		exit(3);
+	result = ((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) < ring->sq_entries);
+	if (result) {
+		index = tail & ring->sq_mask;
+		sqe = &ring->sqes[index];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		// Shares its place with the flags other operations take
+		sqe->poll32_events = events;
+		sqe->user_data = user_data;
+		sqe->addr = addr;
+		ring->sq_array[index] = index;
+		__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+		ring->sq_pending++;
+	}
+	else {
+		LOG(webserve, LOG_ERR, "ERROR: Submission queue full\n");
 	}
 
-	// Bind to the listening socket
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serv_addr.sin_port = htons(port);
+	return result;
+}
 
-	if (bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-		LOG(LOG_ERR, "ERROR: System call: bind\n");
-		exit(3);
-	}
+int uring_enter(Webserve * webserve, unsigned int timeout_usec) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec timeout;
+	unsigned int flags;
+	int result;
 
-	// Listen for connections
-	if (listen(listenfd, 64) <0 ) {
-		LOG(LOG_ERR, "ERROR: System call: listen\n");
-		exit(3);
+	memset(&arg, 0, sizeof(arg));
+	flags = IORING_ENTER_EXT_ARG;
+	if (timeout_usec > 0) {
+		timeout.tv_sec = timeout_usec / 1000000;
+		timeout.tv_nsec = (timeout_usec % 1000000) * 1000;
+		arg.ts = (uint64_t)(uintptr_t)&timeout;
+		flags |= IORING_ENTER_GETEVENTS;
 	}
 
-	// Go in to the main listening loop
-	webserve = check_connect(listenfd);
+	result = syscall(__NR_io_uring_enter, webserve->pollfd, webserve->ring.sq_pending, (timeout_usec > 0) ? 1 : 0, flags, &arg, sizeof(arg));
+	if (result >= 0) {
+		// The number returned is how many were submitted
+		webserve->ring.sq_pending -= (result < webserve->ring.sq_pending) ? result : webserve->ring.sq_pending;
+	}
+	else if ((errno == ETIME) || (errno == EINTR)) {
+		// Nothing happened before the timeout, so nothing was submitted either
+		result = 0;
+	}
 
-	return webserve;
+	return result;
 }
 
-void finish_server(Webserve * webserve) {
-	webserve->quit = true;
-	close(webserve->listenfd);
-	free(webserve);
-}
+bool uring_arm(Webserve * webserve, int fd) {
+	UringPoll * poll;
+	unsigned int events;
+	bool result;
 
-Webserve * check_connect(int listenfd) {
-	Webserve * webserve;
+	result = true;
+	if ((fd >= 0) && (fd < webserve->ring.polls_size)) {
+		poll = &webserve->ring.polls[fd];
+		if ((poll->interest != 0) && (poll->armed == false)) {
+			events = ((poll->interest & EVENT_READ) ? POLLIN : 0) | ((poll->interest & EVENT_WRITE) ? POLLOUT : 0);
+			result = uring_queue(webserve, IORING_OP_POLL_ADD, fd, events, ((uint64_t)poll->generation << 32) | (uint32_t)fd, 0);
+			poll->armed = result;
+		}
+	}
 
-	webserve = calloc(sizeof(Webserve), 1);
-	
-	webserve->listenfd = listenfd;
-	webserve->hit = 0;
+	return result;
+}
 
-	FD_ZERO(&webserve->active_write_fd_set);
-	FD_ZERO(&webserve->active_read_fd_set);
-	FD_SET(listenfd, &webserve->active_read_fd_set);
+int uring_reap(Webserve * webserve) {
+	UringRing * ring;
+	UringPoll * poll;
+	struct io_uring_cqe * cqe;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int flags;
+	int count;
+	int fd;
 
-	// Microseconds
-	webserve->timeout_usec = 1E6;
-	
-	// Set the default conversation callback
-	webserve->conversation_callback = default_conv_callback;
-	
-	webserve->quit = false;
+	ring = &webserve->ring;
+	count = 0;
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while ((head != tail) && (count < EVENTS_MAX)) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		fd = (int)(cqe->user_data & 0xffffffff);
+		poll = NULL;
+		if ((cqe->user_data != URING_IGNORE) && (cqe->user_data & URING_ACCEPT)) {
+			uring_accept_complete(webserve, cqe);
+		}
+		else if ((cqe->user_data != URING_IGNORE) && (fd >= 0) && (fd < ring->polls_size)) {
+			poll = &ring->polls[fd];
+		}
+		// Completions from polls replaced since they were queued are dropped
+		if ((poll != NULL) && poll->armed && (poll->generation == (uint32_t)(cqe->user_data >> 32))) {
+			poll->armed = false;
+			flags = (cqe->res >= 0) ? (unsigned int)cqe->res : POLLERR;
+			webserve->ready[count].fd = fd;
+			webserve->ready[count].events = ((flags & POLLIN) ? EVENT_READ : 0) | ((flags & POLLOUT) ? EVENT_WRITE : 0);
+			if (flags & (POLLERR | POLLHUP)) {
+				webserve->ready[count].events |= poll->interest;
+			}
+			count++;
+		}
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
 
-	return webserve;
+	return count;
 }
 
-void poll_forever(Webserve * webserve) {
-	while (webserve->quit != true) {
-		webserve->quit |= poll_once(webserve);
+bool uring_accept_update(Webserve * webserve, unsigned int index, int to) {
+	UringAccept * accept;
+	unsigned int bit;
+	bool result;
+
+	result = true;
+	accept = &webserve->ring.accepts[index];
+	to &= EVENT_READ;
+	if (to != accept->interest) {
+		accept->interest = to;
+		if (to == 0) {
+			// Withdraw the accepts; any that win the race still have their
+			// connections queued, to be taken once accepting resumes
+			for (bit = 0; bit < URING_ACCEPTS; bit++) {
+				if (accept->outstanding & (1ULL << bit)) {
+					result = uring_queue(webserve, IORING_OP_ASYNC_CANCEL, -1, 0, URING_IGNORE, URING_ACCEPT | ((uint64_t)bit << 32) | index) && result;
+				}
+			}
+		}
+		else {
+			result = uring_accept_arm(webserve, index);
+		}
 	}
+
+	return result;
 }
 
-bool poll_thrice(Webserve * webserve) {
-	int count;
-	for (count = 0; (count < 3) && (webserve->quit != true); count++) {
-		webserve->quit |= poll_once(webserve);
+bool uring_accept_arm(Webserve * webserve, unsigned int index) {
+	UringAccept * accept;
+	unsigned int held;
+	unsigned int limit;
+	unsigned int room;
+	unsigned int bit;
+	bool result;
+
+	result = true;
+	accept = &webserve->ring.accepts[index];
+	if ((index < webserve->listeners_num) && (accept->interest != 0) && (webserve->fd_callback == NULL)) {
+		// Accept no further ahead than one pass of accept_connections() will take,
+		// or than there are connections left to fill
+		held = accept->num + (unsigned int)__builtin_popcountll(accept->outstanding);
+		limit = (webserve->accept_budget < URING_ACCEPTS) ? webserve->accept_budget : URING_ACCEPTS;
+		room = uring_accept_room(webserve);
+		for (bit = 0; (bit < URING_ACCEPTS) && (held < limit) && (room > 0) && result; bit++) {
+			if ((accept->outstanding & (1ULL << bit)) == 0) {
+				result = uring_queue(webserve, IORING_OP_ACCEPT, webserve->listeners[index].fd, SOCK_NONBLOCK | SOCK_CLOEXEC, URING_ACCEPT | ((uint64_t)bit << 32) | index, 0);
+				if (result) {
+					accept->outstanding |= (1ULL << bit);
+					held++;
+					room--;
+				}
+			}
+		}
 	}
 
-	return webserve->quit;
+	return result;
 }
 
-bool poll_once(Webserve * webserve) {
-	struct timeval timeout;
-	int i;
-	int fd;
-	socklen_t size;
-	struct sockaddr_in clientname;
-	fd_set read_fd_set;
-	fd_set write_fd_set;
-	bool conv_result;
-
-	timeout.tv_sec = webserve->timeout_usec / 1E6;
-	timeout.tv_usec = webserve->timeout_usec - (timeout.tv_sec * 1E6);
+unsigned int uring_accept_room(Webserve * webserve) {
+	UringAccept * accept;
+	unsigned int held;
+	unsigned int index;
+	unsigned int room;
 
-	read_fd_set = webserve->active_read_fd_set;
-	write_fd_set = webserve->active_write_fd_set;
-	if (select(FD_SETSIZE, &read_fd_set, &write_fd_set, NULL, &timeout) < 0) {
-		LOG(LOG_ERR, "ERROR: Select\n");
-		webserve->quit = true;
+	// Connections queued or still to come from the kernel count against the limit
+	room = UINT_MAX;
+	if (webserve->max_connections > 0) {
+		held = webserve->connections.live_num;
+		for (index = 0; index < webserve->listeners_num; index++) {
+			accept = &webserve->ring.accepts[index];
+			held += accept->num + (unsigned int)__builtin_popcountll(accept->outstanding);
+		}
+		room = (held < webserve->max_connections) ? (webserve->max_connections - held) : 0;
 	}
 
-	// Service all the sockets with input pending
-	for (i = 0; (i < FD_SETSIZE) && (webserve->quit != true); ++i) {
-		if (FD_ISSET (i, &read_fd_set)) {
-			if (i == webserve->listenfd) {
-				// Connection request on original socket
-				size = sizeof (clientname);
-				fd = accept (i, (struct sockaddr *) &clientname, &size);
-				if (fd < 0) {
-					LOG(LOG_ERR, "ERROR: Accept\n");
-					exit (EXIT_FAILURE);
-				}
-				webserve->hit++;
-				LOG(LOG_INFO, "INFO: Request %d connection from %s\n", webserve->hit, inet_ntoa(clientname.sin_addr));
-				FD_SET (fd, &webserve->active_read_fd_set);
+	return room;
+}
 
-				// Start a conversation
-				conversation_new (webserve, fd);
-			}
-			else {
-				web_read(i, webserve->conversation[i]);
-				FD_CLR (i, &webserve->active_read_fd_set);
+void uring_accept_complete(Webserve * webserve, struct io_uring_cqe const * cqe) {
+	UringAccept * accept;
+	unsigned int index;
+	unsigned int bit;
 
-				if (webserve->conversation_callback) {
-					conv_result = webserve->conversation_callback(webserve->conversation[i]);
-				}
+	index = (unsigned int)(cqe->user_data & 0xffffffff);
+	bit = (unsigned int)((cqe->user_data & ~URING_ACCEPT) >> 32);
+	if ((index < LISTENERS_MAX) && (bit < URING_ACCEPTS)) {
+		accept = &webserve->ring.accepts[index];
+		accept->outstanding &= ~(1ULL << bit);
+		if (cqe->res >= 0) {
+			// Space was set aside when the accept was queued, and the connection is
+			// kept even if the accept has since been withdrawn
+			accept->queue[(accept->head + accept->num) % URING_ACCEPTS] = cqe->res;
+			accept->num++;
+		}
+		else if ((cqe->res != -ECANCELED) && (accept->interest != 0)) {
+			accept->error = -cqe->res;
+		}
+	}
+}
 
-				if ((webserve->conversation_callback == NULL) || (conv_result = false)) {
-					conv_result = default_conv_callback (webserve->conversation[i]);
-				}
+int uring_accept_ready(Webserve * webserve, int count) {
+	UringAccept * accept;
+	unsigned int index;
 
-				FD_SET (i, &webserve->active_write_fd_set);
-			}
+	for (index = 0; (index < webserve->listeners_num) && (count < EVENTS_MAX); index++) {
+		accept = &webserve->ring.accepts[index];
+		if ((accept->interest != 0) && ((accept->num > 0) || (accept->error != 0))) {
+			webserve->ready[count].fd = webserve->listeners[index].fd;
+			webserve->ready[count].events = EVENT_READ;
+			count++;
 		}
+	}
+
+	return count;
+}
 
-		if (FD_ISSET (i, &write_fd_set)) {
-			web_write(i, webserve->conversation[i]);
-			FD_CLR (i, &webserve->active_write_fd_set);
+int uring_accepted(Webserve * webserve, unsigned int index) {
+	UringAccept * accept;
+	int fd;
 
-			// Finish the conversation
-			conversation_clear(webserve, i);
-		}
+	fd = -1;
+	accept = &webserve->ring.accepts[index];
+	if (accept->num > 0) {
+		fd = accept->queue[accept->head];
+		accept->head = (accept->head + 1) % URING_ACCEPTS;
+		accept->num--;
 	}
-	
-	return webserve->quit;
+	else if (accept->error != 0) {
+		errno = accept->error;
+		accept->error = 0;
+	}
+	else {
+		errno = EAGAIN;
+	}
+
+	return fd;
 }
 
-void conversation_new (Webserve * webserve, int fd) {
-	if ((fd >= 0) && (fd < FD_SETSIZE) && (webserve != NULL)) {
-		if (webserve->conversation[fd] != NULL) {
-			// There's an old lingering conversation, which we must clear
-			if (webserve->conversation[fd]->request_header) {
-				free(webserve->conversation[fd]->request_header);
-			}
-			if (webserve->conversation[fd]->request_body) {
-				free(webserve->conversation[fd]->request_body);
-			}
-			if (webserve->conversation[fd]->response) {
-				free(webserve->conversation[fd]->response);
-			}
-			free(webserve->conversation[fd]);
+void uring_accept_limit(Webserve * webserve) {
+	unsigned int index;
+	int interest;
+
+	// Accepts already with the kernel were queued under the old limits, so
+	// they're withdrawn; new ones go on as the old ones report back
+	for (index = 0; index < webserve->listeners_num; index++) {
+		interest = webserve->ring.accepts[index].interest;
+		if (interest != 0) {
+			uring_accept_update(webserve, index, 0);
+			uring_accept_update(webserve, index, interest);
 		}
-			
-		// Create the new conversation structure
-		webserve->conversation[fd] = calloc(sizeof(WebserveConv), 1);
-		webserve->conversation[fd]->hit = webserve->hit;
-		webserve->conversation[fd]->type = RESPONSE_ERROR;
 	}
 }
 
-void conversation_clear(Webserve * webserve, int fd) {
-	if ((fd > 0) && (fd < FD_SETSIZE) && (webserve != NULL)) {
-		if (webserve->conversation[fd] != NULL) {
-			// Clear the conversation content
-			if (webserve->conversation[fd]->request_header) {
-				free(webserve->conversation[fd]->request_header);
-			}
-			if (webserve->conversation[fd]->request_body) {
-				free(webserve->conversation[fd]->request_body);
-			}
-			if (webserve->conversation[fd]->response) {
-				free(webserve->conversation[fd]->response);
-			}
-			free(webserve->conversation[fd]);
-			
-			webserve->conversation[fd] = NULL;
+void uring_accept_settle(Webserve * webserve) {
+	unsigned int tries;
+	unsigned int index;
+	bool outstanding;
+
+	// Nothing waits on the ring once another loop takes over, so the withdrawn
+	// accepts are submitted now and seen through until each has reported back
+	outstanding = true;
+	for (tries = 0; outstanding && (tries < URING_SETTLE_TRIES); tries++) {
+		uring_enter(webserve, URING_SETTLE_USEC);
+		uring_reap(webserve);
+		outstanding = false;
+		for (index = 0; index < webserve->listeners_num; index++) {
+			outstanding = outstanding || (webserve->ring.accepts[index].outstanding != 0);
 		}
 	}
+	if (outstanding) {
+		LOG(webserve, LOG_WARNING, "WARNING: Accepts still outstanding on handover\n");
+	}
 }
 
-void set_conv_callback(Webserve * webserve, WebservConvCallback conversation_callback) {
-	if (webserve != NULL) {
-		if (conversation_callback != NULL) {
-			webserve->conversation_callback = conversation_callback;
+#else
+
+bool events_init(Webserve * webserve) {
+	FD_ZERO(&webserve->active_write_fd_set);
+	FD_ZERO(&webserve->active_read_fd_set);
+	webserve->maxfd = -1;
+	webserve->nextfd = 0;
+
+	return true;
+}
+
+void events_finish(Webserve * webserve) {
+	FD_ZERO(&webserve->active_write_fd_set);
+	FD_ZERO(&webserve->active_read_fd_set);
+	webserve->maxfd = -1;
+}
+
+bool backend_update(Webserve * webserve, int fd, int from, int to) {
+	bool result;
+
+	result = false;
+	if ((fd >= 0) && (fd < FD_SETSIZE)) {
+		if (to & EVENT_READ) {
+			FD_SET(fd, &webserve->active_read_fd_set);
 		}
 		else {
-			webserve->conversation_callback = default_conv_callback;
+			FD_CLR(fd, &webserve->active_read_fd_set);
+		}
+		if (to & EVENT_WRITE) {
+			FD_SET(fd, &webserve->active_write_fd_set);
+		}
+		else {
+			FD_CLR(fd, &webserve->active_write_fd_set);
+		}
+		if (fd > webserve->maxfd) {
+			webserve->maxfd = fd;
 		}
+		result = true;
 	}
+
+	return result;
 }
 
-bool default_conv_callback (WebserveConv * conversation) {
-	conversation->response = malloc(RESPONSE_LENGTH + 1);
-	strncpy(conversation->response, RESPONSE_CONTENT, RESPONSE_LENGTH);
-	conversation->response_size = RESPONSE_LENGTH;
-	return true;
+int events_wait(Webserve * webserve, unsigned int timeout_usec) {
+	struct timeval timeout;
+	fd_set read_fd_set;
+	fd_set write_fd_set;
+	int count;
+	int found;
+	int scanned;
+	int fd;
+	int range;
+
+	timeout.tv_sec = timeout_usec / 1000000;
+	timeout.tv_usec = timeout_usec % 1000000;
+
+	read_fd_set = webserve->active_read_fd_set;
+	write_fd_set = webserve->active_write_fd_set;
+	range = webserve->maxfd + 1;
+	count = select(range, &read_fd_set, &write_fd_set, NULL, &timeout);
+
+	// Start each scan where the last one stopped so high descriptors aren't starved
+	found = 0;
+	fd = (webserve->nextfd < range) ? webserve->nextfd : 0;
+	for (scanned = 0; (count > 0) && (scanned < range) && (found < EVENTS_MAX); scanned++) {
+		webserve->ready[found].events = (FD_ISSET(fd, &read_fd_set) ? EVENT_READ : 0) | (FD_ISSET(fd, &write_fd_set) ? EVENT_WRITE : 0);
+		if (webserve->ready[found].events != 0) {
+			webserve->ready[found].fd = fd;
+			found++;
+		}
+		fd = (fd + 1) % range;
+	}
+	webserve->nextfd = fd;
+
+	return (count < 0) ? count : found;
 }
 
+#endif
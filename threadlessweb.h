@@ -34,6 +34,17 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <arpa/inet.h>
+#include <sys/types.h>
+
+// Logging levels, as passed to set_log_level()
+#if defined(_WIN32) || defined(_WIN64)
+#define LOG_ERR 3
+#define LOG_WARNING 4
+#define LOG_INFO 6
+#define LOG_DEBUG 7
+#else
+#include <syslog.h>
+#endif
 
 // Defines
 
@@ -41,6 +52,10 @@
 #define RESPONSE_ERROR      42
 #define RESPONSE_FORBIDDEN 403
 
+// Readiness flags, as used when driving the server from another event loop
+#define EVENT_READ (1 << 0)
+#define EVENT_WRITE (1 << 1)
+
 // Structure definitions
 
 typedef enum {
@@ -48,39 +63,288 @@ typedef enum {
 	
 	REQUEST_GET,
 	REQUEST_POST,
+	REQUEST_HEAD,
+	REQUEST_PUT,
+	REQUEST_DELETE,
+	REQUEST_OPTIONS,
+	REQUEST_PATCH,
+	REQUEST_CONNECT,
+	REQUEST_TRACE,
 	
 	REQUEST_NUM
 } REQUEST;
 
+// Routes can match any method
+#define REQUEST_ANY REQUEST_NUM
+
+// Headers the parser picks out of every request
+typedef enum {
+	HEADER_HOST,
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONTENT_TYPE,
+	HEADER_CONNECTION,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_EXPECT,
+	HEADER_COOKIE,
+
+	HEADER_KNOWN_NUM
+} HEADER;
+
+// Number of request headers indexed; any beyond this are still searchable
+#define HEADER_INDEX_MAX 32
+
+// A view into the receive buffer, not null terminated
+typedef struct _WebserveSlice {
+	char const * data;
+	size_t size;
+} WebserveSlice;
+
+// Number of path parameters a route can capture
+#define ROUTE_PARAMS_MAX 8
+
+typedef struct _WebserveParam {
+	char const * name;
+	WebserveSlice value;
+} WebserveParam;
+
+typedef struct _WebserveHeader {
+	unsigned int hash;
+	WebserveSlice name;
+	WebserveSlice value;
+} WebserveHeader;
+
 typedef struct _Webserve Webserve;
+typedef struct _WebservePool WebservePool;
+typedef struct _WebserveResponse WebserveResponse;
+typedef struct _WebserveConv WebserveConv;
+
+// Fills buffer with up to size bytes of a streamed response, returning how
+// many were written, 0 at the end of the stream or -1 to abandon it
+typedef ssize_t (*WebserveProducer)(WebserveConv * conversation, char * buffer, size_t size);
 
-typedef struct _WebserveConv {
+struct _WebserveConv {
 	int hit;
 	REQUEST type;
-	char * request_header;
+	// Views into the receive buffer, not null terminated
+	char const * request_header;
 	size_t request_header_size;
-	char * request_body;
+	char const * request_body;
 	size_t request_body_size;
+	// Status code of the response, or 0 for 200 OK
 	int response_code;
 	char * response;
 	size_t response_size;
-} WebserveConv;
+	// Content type of the response, or NULL for the default
+	char const * response_type;
+	// File to send in place of response, or -1; closed once sent
+	int response_fd;
+	off_t response_offset;
+	size_t response_length;
+	// Prepared response to send in place of all the above
+	WebserveResponse const * response_prepared;
+	// Producer for a response of unknown length, with data for its own use
+	WebserveProducer response_producer;
+	void * response_producer_data;
+	// Set to stop a GET response going in the response cache
+	bool no_cache;
+	// The request line, split up
+	WebserveSlice method;
+	WebserveSlice path;
+	WebserveSlice query;
+	// HTTP/1.1 is 11, HTTP/1.0 is 10, and 9 if no version was given
+	int version;
+	// Values of the common headers, with NULL data if they're absent
+	WebserveSlice known[HEADER_KNOWN_NUM];
+	// Path parameters captured by the matching route
+	unsigned int params_num;
+	WebserveParam params[ROUTE_PARAMS_MAX];
+	// Every header in the order received; kept last so resets can skip it
+	unsigned int headers_num;
+	WebserveHeader headers[HEADER_INDEX_MAX];
+};
+
+// Log-linear histogram buckets, each power of two split into 16
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((32 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct _WebserveHistogram {
+	unsigned long count;
+	unsigned long long total;
+	unsigned long max;
+	unsigned long buckets[HISTOGRAM_BUCKETS];
+} WebserveHistogram;
 
+typedef struct _WebserveStats {
+	// Connections accepted, in total and per poll
+	unsigned long accepts;
+	unsigned long accept_ticks;
+	unsigned int accepts_last_tick;
+	unsigned int accepts_max_tick;
+	// Times accepting stopped for a while, having run out of descriptors
+	unsigned long accept_pauses;
+	// Connections turned away for coming too often from the same address
+	unsigned long rate_limited;
+	unsigned int active_connections;
+	// Requests served
+	unsigned long requests;
+	unsigned long requests_by_type[REQUEST_NUM];
+	// Requests refused with an error response
+	unsigned long forbidden;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+	// Bodies compressed, counting each prepared variant once
+	unsigned long compressions;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	// Timings, in microseconds
+	WebserveHistogram callback_usec;
+	WebserveHistogram latency_usec;
+	WebserveHistogram poll_usec;
+} WebserveStats;
+
+// Fill in the response; returning false sends the default response instead
 typedef bool (*WebservConvCallback)(WebserveConv * conversation);
 
+// Options for a listening socket; zeroed, each is left at the system default
+typedef struct _WebserveListenOptions {
+	// Don't wake the server until the client sends something, for up to this long
+	unsigned int defer_accept_sec;
+	// Queue for TCP Fast Open, which lets a request arrive along with the SYN
+	int fastopen_queue;
+	// Buffer sizes, inherited by the connections accepted
+	int receive_buffer;
+	int send_buffer;
+	// Share the address with other sockets, as the servers in a pool do
+	bool reuseport;
+	// Only accept IPv6 connections on an IPv6 socket, rather than IPv4 too
+	bool v6only;
+} WebserveListenOptions;
+
+typedef struct _WebserveEvent {
+	int fd;
+	int events;
+} WebserveEvent;
+
+// Told each time the events wanted on a descriptor change, with 0 meaning the
+// descriptor no longer needs watching
+typedef void (*WebserveFdCallback)(Webserve * webserve, int fd, int events, void * data);
+
+// Receives a request body piece by piece as it arrives, decoded if it was
+// chunked; returning false refuses the request
+typedef bool (*WebserveBodyCallback)(WebserveConv * conversation, char const * data, size_t size);
+
 // Function prototypes
 
-// Run the server
+// Run the server; NULL if it couldn't be started
 Webserve * start_server(int port);
 bool poll_once(Webserve * webserve);
 bool poll_thrice(Webserve * webserve);
+// Keep polling until the time has been used up
+bool poll_for(Webserve * webserve, unsigned int budget_usec);
 void poll_forever(Webserve * webserve);
 void finish_server(Webserve * webserve);
 
+// Listen on more sockets in the same poll loop, up to eight in all; address is
+// numeric IPv4 or IPv6, or NULL for any IPv6 address, and a Unix domain socket
+// path starting with '@' is in Linux's abstract namespace
+Webserve * start_server_empty(void);
+bool add_listener(Webserve * webserve, char const * address, int port, WebserveListenOptions const * options);
+bool add_listener_unix(Webserve * webserve, char const * path, WebserveListenOptions const * options);
+
+// Let another event loop do the waiting instead of poll_once(); it watches the
+// descriptors it's told about, passes on any events with process_events(), and
+// calls process_timeouts() once get_timeout_usec() has elapsed
+void set_fd_callback(Webserve * webserve, WebserveFdCallback callback, void * data);
+unsigned int get_fds(Webserve * webserve, WebserveEvent * fds, unsigned int size);
+bool process_events(Webserve * webserve, int fd, int events);
+bool process_timeouts(Webserve * webserve);
+unsigned int get_timeout_usec(Webserve * webserve);
+
+// Run several servers sharing a port, each with its own SO_REUSEPORT socket
+WebservePool * start_server_pool(int port, unsigned int servers, bool affinity);
+unsigned int pool_size(WebservePool * pool);
+Webserve * pool_server(WebservePool * pool, unsigned int index);
+void pool_forever(WebservePool * pool);
+void pool_quit(WebservePool * pool);
+void finish_server_pool(WebservePool * pool);
+
 // Configure the server
 void set_timeout_usec(Webserve * webserve, unsigned int usec);
+void set_keepalive_timeout_usec(Webserve * webserve, unsigned int usec);
+
+// Trade CPU for latency: polls spin rather than block for usec after activity,
+// and the kernel can be asked to busy poll connections with SO_BUSY_POLL
+void set_spin_usec(Webserve * webserve, unsigned int usec);
+void set_busy_poll_usec(Webserve * webserve, unsigned int usec);
+void set_read_timeout_usec(Webserve * webserve, unsigned int usec);
+void set_write_timeout_usec(Webserve * webserve, unsigned int usec);
+void set_keepalive_max_requests(Webserve * webserve, unsigned int requests);
 void set_conv_callback(Webserve * webserve, WebservConvCallback conversation_callback);
 
+// Request bodies are kept whole for the callback up to a limit, 1 MiB by
+// default; a body callback takes them in pieces instead, with no limit
+void set_max_body_size(Webserve * webserve, size_t size);
+void set_body_callback(Webserve * webserve, WebserveBodyCallback body_callback);
+void set_listen_backlog(Webserve * webserve, int backlog);
+void set_accept_budget(Webserve * webserve, unsigned int accepts);
+
+// Admission control: cap the connections open at once, and the rate each
+// client address may open them at, with burst saved up; 0 turns either off
+void set_max_connections(Webserve * webserve, unsigned int connections);
+void set_rate_limit(Webserve * webserve, unsigned int per_second, unsigned int burst);
+
+// Send requests for matching paths to their own callback, falling back to the
+// conversation callback; ":name" matches a path segment, a final "*" the rest
+bool add_route(Webserve * webserve, REQUEST method, char const * pattern, WebservConvCallback callback);
+
+// Keep GET and HEAD responses for reuse, up to size bytes in total; 0 turns
+// it off. Entries are keyed on the method, Host and request target
+void set_response_cache(Webserve * webserve, size_t size, unsigned int ttl_usec);
+bool add_cache_vary(Webserve * webserve, char const * header);
+
+// Compress bodies of at least min_size bytes for clients that accept it, with
+// prepared responses compressed once up front; 0, the default, turns it off.
+// It can be changed at any time, and copies still being sent are kept until
+// they're done with
+void set_compression(Webserve * webserve, size_t min_size);
+
+// Control logging; levels are the syslog ones, LOG_WARNING by default
+void set_log_level(Webserve * webserve, int level);
+void set_log_async(Webserve * webserve, unsigned int entries);
+void flush_log(Webserve * webserve);
+
+// Find out how the server is doing
+void get_stats(Webserve * webserve, WebserveStats * stats);
+unsigned long histogram_percentile(WebserveHistogram const * histogram, double percentile);
+void set_stats_path(Webserve * webserve, char const * path);
+
+// Respond later, rather than from within the callback; the conversation stays
+// valid until conv_complete() is called, which is safe from any thread
+void conv_defer(WebserveConv * conversation);
+void conv_complete(Webserve * webserve, WebserveConv * conversation);
+
+// Allocate memory that lasts until the conversation ends
+void * conv_alloc(WebserveConv * conversation, size_t size);
+
+// Look up a request header by name, case insensitively
+char const * conv_header(WebserveConv const * conversation, char const * name, size_t * value_size);
+
+// Build a complete response once, to be sent as often as needed with no
+// further formatting; it lasts until the server is finished
+WebserveResponse * add_response(Webserve * webserve, int code, char const * type, void const * body, size_t size);
+void conv_send_response(WebserveConv * conversation, WebserveResponse const * response);
+
+// Look up a path parameter captured by the route
+char const * conv_param(WebserveConv const * conversation, char const * name, size_t * value_size);
+
+// Respond with part of a file, which the conversation takes ownership of
+void conv_send_file(WebserveConv * conversation, int fd, off_t offset, size_t length);
+
+// Respond with whatever the producer generates, a chunk at a time as the
+// socket has room for it, so the length needn't be known in advance
+void conv_send_stream(WebserveConv * conversation, WebserveProducer producer, void * data);
+
 // Function definitions
 
 #endif
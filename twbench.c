@@ -0,0 +1,499 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <david@flypig.co.uk>
+ * @version 1.0
+ *
+ * @section LICENSE
+ *
+ * @brief Load generator for ThreadlessWeb
+ * @section DESCRIPTION
+ *
+ * Opens many concurrent connections to a ThreadlessWeb server and fires
+ * requests at it as fast as it will answer them, then reports the request
+ * rate and latency percentiles. By default an in-process server is started on
+ * a thread of its own, so response sizes can be controlled; alternatively an
+ * external server can be targeted.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "threadlessweb.h"
+
+// Defines
+
+#define BENCH_BUFSIZE 65536
+#define PIPELINE_MAX 64
+
+// Structure definitions
+
+typedef struct _BenchOptions {
+	char const * host;
+	int port;
+	bool external;
+	int connections;
+	double duration;
+	bool keep_alive;
+	int pipeline;
+	size_t request_size;
+	size_t response_size;
+	unsigned int max_requests;
+	unsigned int spin_usec;
+} BenchOptions;
+
+typedef struct _BenchConn {
+	int fd;
+	// Send times of the requests waiting for a response
+	uint64_t sent[PIPELINE_MAX];
+	int sent_head;
+	int sent_num;
+	// Partially written request
+	size_t request_pos;
+	// Partially read response
+	char * buffer;
+	size_t buffer_used;
+} BenchConn;
+
+typedef struct _BenchResults {
+	unsigned long requests;
+	unsigned long errors;
+	unsigned long connects;
+	uint64_t * latencies;
+	unsigned long latencies_size;
+} BenchResults;
+
+static BenchOptions options;
+static char * request;
+static size_t request_length;
+static char * response;
+static Webserve * webserve;
+static bool server_stop;
+
+// Function prototypes
+
+static bool parse_options(int argc, char ** argv);
+static void display_help();
+static void * server_thread(void * data);
+static bool bench_callback(WebserveConv * conversation);
+static uint64_t now_usec();
+static bool bench_connect(BenchConn * conn, BenchResults * results);
+static void bench_disconnect(BenchConn * conn);
+static bool bench_send(BenchConn * conn);
+static bool bench_receive(BenchConn * conn, BenchResults * results, bool * closed);
+static long response_length(char const * buffer, size_t size);
+static void record_latency(BenchResults * results, uint64_t latency);
+static int compare_latency(void const * first, void const * second);
+static void report(BenchResults * results, double elapsed);
+
+// Function definitions
+
+int main(int argc, char ** argv) {
+	pthread_t server;
+	BenchConn * conns;
+	BenchResults results;
+	struct pollfd * fds;
+	uint64_t start;
+	uint64_t end;
+	int index;
+	int ready;
+	int depth;
+	bool closed;
+	bool ok;
+
+	if (parse_options(argc, argv) == false) {
+		display_help();
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	// The request is the same every time, padded out to the requested size
+	request = malloc(options.request_size + 256);
+	if (options.request_size > 0) {
+		request_length = sprintf(request, "POST /bench HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\nContent-Length: %zu\r\n\r\n", options.host, options.keep_alive ? "keep-alive" : "close", options.request_size);
+		memset(request + request_length, 'x', options.request_size);
+		request_length += options.request_size;
+	}
+	else {
+		request_length = sprintf(request, "GET /bench HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", options.host, options.keep_alive ? "keep-alive" : "close");
+	}
+
+	if (options.external == false) {
+		response = malloc(options.response_size + 1);
+		memset(response, 'y', options.response_size);
+		webserve = start_server(options.port);
+		if (webserve == NULL) {
+			fprintf(stderr, "ERROR: Unable to start the server on port %d\n", options.port);
+			return 1;
+		}
+		set_conv_callback(webserve, bench_callback);
+		set_keepalive_max_requests(webserve, options.max_requests);
+		set_timeout_usec(webserve, 1E5);
+		set_spin_usec(webserve, options.spin_usec);
+		pthread_create(&server, NULL, server_thread, NULL);
+	}
+
+	memset(&results, 0, sizeof(results));
+	conns = calloc(sizeof(BenchConn), options.connections);
+	fds = calloc(sizeof(struct pollfd), options.connections);
+	ok = true;
+	for (index = 0; (index < options.connections) && ok; index++) {
+		conns[index].buffer = malloc(BENCH_BUFSIZE);
+		ok = bench_connect(&conns[index], &results);
+	}
+	if (ok == false) {
+		fprintf(stderr, "ERROR: Unable to connect to %s:%d\n", options.host, options.port);
+		return 1;
+	}
+
+	printf("INFO: %d connections, %s, pipeline %d, request %zu bytes, response %zu bytes, %.1f seconds\n", options.connections, options.keep_alive ? "keep-alive" : "close", options.pipeline, options.request_size, options.response_size, options.duration);
+
+	start = now_usec();
+	end = start + (uint64_t)(options.duration * 1E6);
+	while (now_usec() < end) {
+		for (index = 0; index < options.connections; index++) {
+			// Keep the pipeline full
+			depth = options.keep_alive ? options.pipeline : 1;
+			while ((conns[index].fd >= 0) && (conns[index].request_pos == 0) && (conns[index].sent_num < depth)) {
+				conns[index].sent[(conns[index].sent_head + conns[index].sent_num) % PIPELINE_MAX] = now_usec();
+				conns[index].sent_num++;
+				if (bench_send(&conns[index]) == false) {
+					break;
+				}
+			}
+			if ((conns[index].fd >= 0) && (conns[index].request_pos > 0)) {
+				bench_send(&conns[index]);
+			}
+			fds[index].fd = conns[index].fd;
+			fds[index].events = POLLIN | ((conns[index].request_pos > 0) ? POLLOUT : 0);
+			fds[index].revents = 0;
+		}
+
+		ready = poll(fds, options.connections, 100);
+		for (index = 0; (index < options.connections) && (ready > 0); index++) {
+			if (fds[index].revents & (POLLIN | POLLERR | POLLHUP)) {
+				closed = false;
+				if (bench_receive(&conns[index], &results, &closed) == false) {
+					results.errors++;
+					closed = true;
+				}
+				if (closed) {
+					// Requests still in flight are lost; start over on a new connection
+					results.errors += conns[index].sent_num;
+					bench_disconnect(&conns[index]);
+					bench_connect(&conns[index], &results);
+				}
+			}
+		}
+	}
+	report(&results, (now_usec() - start) / 1E6);
+
+	for (index = 0; index < options.connections; index++) {
+		bench_disconnect(&conns[index]);
+		free(conns[index].buffer);
+	}
+	free(conns);
+	free(fds);
+	free(results.latencies);
+	free(request);
+
+	if (options.external == false) {
+		__atomic_store_n(&server_stop, true, __ATOMIC_RELAXED);
+		pthread_join(server, NULL);
+		finish_server(webserve);
+		free(response);
+	}
+
+	return 0;
+}
+
+static bool parse_options(int argc, char ** argv) {
+	int option;
+
+	options.host = "127.0.0.1";
+	options.port = 18080;
+	options.external = false;
+	options.connections = 64;
+	options.duration = 5.0;
+	options.keep_alive = true;
+	options.pipeline = 1;
+	options.request_size = 0;
+	options.response_size = 64;
+	options.max_requests = 1000000;
+	options.spin_usec = 0;
+
+	while ((option = getopt(argc, argv, "h:p:xc:d:kKn:b:r:m:s:")) != -1) {
+		switch (option) {
+		case 'h':
+			options.host = optarg;
+			options.external = true;
+			break;
+		case 'p':
+			options.port = atoi(optarg);
+			break;
+		case 'x':
+			options.external = true;
+			break;
+		case 'c':
+			options.connections = atoi(optarg);
+			break;
+		case 'd':
+			options.duration = atof(optarg);
+			break;
+		case 'k':
+			options.keep_alive = true;
+			break;
+		case 'K':
+			options.keep_alive = false;
+			break;
+		case 'n':
+			options.pipeline = atoi(optarg);
+			break;
+		case 'b':
+			options.request_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			options.response_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			options.max_requests = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			options.spin_usec = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			return false;
+		}
+	}
+
+	return (options.connections > 0) && (options.pipeline > 0) && (options.pipeline <= PIPELINE_MAX) && (options.duration > 0) && (options.port > 0);
+}
+
+static void display_help() {
+	printf("Syntax: twbench [options]\n"
+		"Measures requests per second and latency of a ThreadlessWeb server.\n"
+		"  -h <host>   Target an external server on this host\n"
+		"  -p <port>   Port to use (default 18080)\n"
+		"  -x          Target an external server on localhost\n"
+		"  -c <num>    Concurrent connections (default 64)\n"
+		"  -d <secs>   Duration of the run (default 5)\n"
+		"  -k / -K     Use keep-alive (default) / close after each request\n"
+		"  -n <depth>  Requests to pipeline on each connection (default 1)\n"
+		"  -b <bytes>  POST a body of this size rather than GET\n"
+		"  -r <bytes>  Response size from the in-process server (default 64)\n"
+		"  -m <num>    Requests per connection on the in-process server\n"
+		"  -s <usec>   Spin window of the in-process server (default 0)\n"
+		"Example: twbench -c 128 -d 10 -n 4\n"
+		"");
+}
+
+static void * server_thread(void * data) {
+	// Stop once the benchmark has finished with the server
+	while (__atomic_load_n(&server_stop, __ATOMIC_RELAXED) == false) {
+		poll_once(webserve);
+	}
+
+	return NULL;
+}
+
+static bool bench_callback(WebserveConv * conversation) {
+	// Respond straight from the shared buffer
+	conversation->response = conv_alloc(conversation, options.response_size);
+	memcpy(conversation->response, response, options.response_size);
+	conversation->response_size = options.response_size;
+
+	return true;
+}
+
+static uint64_t now_usec() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static bool bench_connect(BenchConn * conn, BenchResults * results) {
+	struct sockaddr_in address;
+	int value;
+
+	conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+	conn->sent_head = 0;
+	conn->sent_num = 0;
+	conn->request_pos = 0;
+	conn->buffer_used = 0;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(options.port);
+	inet_pton(AF_INET, options.host, &address.sin_addr);
+
+	if ((conn->fd < 0) || (connect(conn->fd, (struct sockaddr *)&address, sizeof(address)) < 0)) {
+		if (conn->fd >= 0) {
+			close(conn->fd);
+		}
+		conn->fd = -1;
+		return false;
+	}
+
+	value = 1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+	results->connects++;
+
+	return true;
+}
+
+static void bench_disconnect(BenchConn * conn) {
+	if (conn->fd >= 0) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+}
+
+static bool bench_send(BenchConn * conn) {
+	ssize_t written;
+
+	// Returns true once the whole request has gone
+	written = send(conn->fd, request + conn->request_pos, request_length - conn->request_pos, MSG_NOSIGNAL);
+	if (written > 0) {
+		conn->request_pos += written;
+	}
+	if (conn->request_pos >= request_length) {
+		conn->request_pos = 0;
+		return true;
+	}
+
+	return false;
+}
+
+static bool bench_receive(BenchConn * conn, BenchResults * results, bool * closed) {
+	ssize_t received;
+	long length;
+	uint64_t now;
+
+	received = recv(conn->fd, conn->buffer + conn->buffer_used, BENCH_BUFSIZE - conn->buffer_used, 0);
+	if (received == 0) {
+		*closed = true;
+		return true;
+	}
+	if (received < 0) {
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR));
+	}
+	conn->buffer_used += received;
+
+	// Take off as many complete responses as have arrived
+	now = now_usec();
+	while ((length = response_length(conn->buffer, conn->buffer_used)) > 0) {
+		if (conn->sent_num > 0) {
+			record_latency(results, now - conn->sent[conn->sent_head]);
+			conn->sent_head = (conn->sent_head + 1) % PIPELINE_MAX;
+			conn->sent_num--;
+		}
+		results->requests++;
+		if (strncmp(conn->buffer, "HTTP/1.1 200", 12) != 0) {
+			results->errors++;
+		}
+		memmove(conn->buffer, conn->buffer + length, conn->buffer_used - length);
+		conn->buffer_used -= length;
+
+		if (options.keep_alive == false) {
+			// The server closes after every response
+			*closed = true;
+		}
+	}
+
+	if ((length < 0) || (conn->buffer_used >= BENCH_BUFSIZE)) {
+		// Couldn't make sense of the response, or it's too large to hold
+		conn->buffer_used = 0;
+		return false;
+	}
+
+	return true;
+}
+
+static long response_length(char const * buffer, size_t size) {
+	char const * end;
+	char const * line;
+	long header;
+	long body;
+
+	// The server may use either CRLF or plain LF line endings
+	end = NULL;
+	for (line = buffer; (end == NULL) && (line + 1 < buffer + size); line++) {
+		if ((line[0] == '\n') && (line[1] == '\n')) {
+			end = line + 2;
+		}
+		else if ((line + 3 < buffer + size) && (memcmp(line, "\r\n\r\n", 4) == 0)) {
+			end = line + 4;
+		}
+	}
+	if (end == NULL) {
+		return 0;
+	}
+
+	header = end - buffer;
+	body = -1;
+	for (line = buffer; (line != NULL) && (line < end); line = memchr(line, '\n', end - line)) {
+		line++;
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			body = strtol(line + 15, NULL, 10);
+			break;
+		}
+	}
+	if (body < 0) {
+		return -1;
+	}
+
+	return (header + body <= size) ? header + body : 0;
+}
+
+static void record_latency(BenchResults * results, uint64_t latency) {
+	uint64_t * latencies;
+
+	if (results->requests >= results->latencies_size) {
+		results->latencies_size = (results->latencies_size > 0) ? results->latencies_size * 2 : 65536;
+		latencies = realloc(results->latencies, sizeof(uint64_t) * results->latencies_size);
+		if (latencies == NULL) {
+			return;
+		}
+		results->latencies = latencies;
+	}
+	results->latencies[results->requests] = latency;
+}
+
+static int compare_latency(void const * first, void const * second) {
+	uint64_t a;
+	uint64_t b;
+
+	a = *(uint64_t const *)first;
+	b = *(uint64_t const *)second;
+
+	return (a > b) - (a < b);
+}
+
+static void report(BenchResults * results, double elapsed) {
+	unsigned long count;
+
+	count = results->requests;
+	printf("Requests: %lu in %.2f seconds, %lu errors, %lu connections\n", count, elapsed, results->errors, results->connects);
+	printf("Requests/sec: %.0f\n", count / elapsed);
+	if ((count > 0) && (results->latencies != NULL)) {
+		qsort(results->latencies, count, sizeof(uint64_t), compare_latency);
+		printf("Latency (us): p50 %llu, p99 %llu, p999 %llu, max %llu\n", (unsigned long long)results->latencies[count / 2], (unsigned long long)results->latencies[(count * 99) / 100], (unsigned long long)results->latencies[(count * 999) / 1000], (unsigned long long)results->latencies[count - 1]);
+	}
+}
@@ -29,6 +29,7 @@
 // Structure definitions
 
 static bool quit;
+static WebservePool * pool;
 
 // Function prototypes
 
@@ -41,24 +42,52 @@ static void display_help();
 int main(int argc, char **argv) {
 	Webserve * webserve;
 	int port;
+	int servers;
 
 	quit = false;
+	pool = NULL;
 
-	// Get the port to use from the command line
+	// Get the port and number of servers to use from the command line
 	port = 0;
-	if (argc == 2) {
+	servers = 1;
+	if ((argc == 2) || (argc == 3)) {
 		port = atoi(argv[1]);
 	}
+	if (argc == 3) {
+		servers = atoi(argv[2]);
+	}
 
-	if (port == 0) {
+	if ((port == 0) || (servers < 1)) {
 		display_help();
 	}
+	else if (servers > 1) {
+		configure_interrupt();
+
+		// Start up one server per thread, all sharing the port
+		printf("INFO: Webserver starting on port %d with %d servers, pid %d\n", port, servers, getpid());
+		pool = start_server_pool(port, servers, true);
+		if (pool == NULL) {
+			printf("ERROR: Unable to start the webservers\n");
+			return 1;
+		}
+
+		// Poll for connections until interrupted
+		pool_forever(pool);
+
+		// Clear up
+		finish_server_pool(pool);
+		printf("INFO: Webserver closed down\n");
+	}
 	else {
 		configure_interrupt();
 
 		// Start up
 		printf("INFO: Webserver starting on port %d, pid %d\n", port, getpid());
 		webserve = start_server(port);
+		if (webserve == NULL) {
+			printf("ERROR: Unable to start the webserver\n");
+			return 1;
+		}
 		// Set polls to block for 1 second
 		set_timeout_usec(webserve, 1E6);
 
@@ -76,6 +105,7 @@ int main(int argc, char **argv) {
 static void interrupt (int sig, siginfo_t * siginfo, void * context) {
 	printf("\nINFO: Interrupt signal received\n");
 	quit = true;
+	pool_quit(pool);
 }
 
 static void configure_interrupt() {
@@ -92,8 +122,9 @@ static void configure_interrupt() {
 }
 
 static void display_help() {
-	printf("Syntax: threadlessweb <port>\n"
+	printf("Syntax: threadlessweb <port> [servers]\n"
 		"Runs a simple webserver that always responds in the same way.\n"
+		"Optionally runs several servers on their own threads.\n"
 		"Example: threadlessweb 1337\n"
 		"");
 }
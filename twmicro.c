@@ -0,0 +1,191 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <david@flypig.co.uk>
+ * @version 1.0
+ *
+ * @section LICENSE
+ *
+ * @brief Microbenchmarks for the ThreadlessWeb request path
+ * @section DESCRIPTION
+ *
+ * Times the individual stages a request passes through (parsing the request,
+ * preparing the response and writing it to a socket) in isolation, so that
+ * changes to any one of them can be measured without the noise of a full
+ * network round trip. The library source is included directly so that its
+ * internal functions can be called.
+ *
+ */
+
+#include "threadlessweb.c"
+
+// Defines
+
+#define MICRO_BATCH 64
+#define MICRO_BATCHES 4096
+
+// Structure definitions
+
+typedef void (*MicroFunction)(Webserve * webserve, Connection * connection, void * data);
+
+typedef struct _MicroRequest {
+	char const * request;
+	size_t length;
+} MicroRequest;
+
+typedef struct _MicroWrite {
+	int drain;
+	char * sink;
+} MicroWrite;
+
+// Function prototypes
+
+uint64_t time_nsec();
+int compare_nsec(void const * first, void const * second);
+void micro_run(char const * name, MicroFunction function, Webserve * webserve, Connection * connection, void * data);
+void micro_parse(Webserve * webserve, Connection * connection, void * data);
+void micro_prepare(Webserve * webserve, Connection * connection, void * data);
+void micro_write(Webserve * webserve, Connection * connection, void * data);
+
+// Function definitions
+
+int main(int argc, char ** argv) {
+	Webserve * webserve;
+	Connection * connection;
+	int pair[2];
+	int value;
+	MicroRequest small;
+	MicroRequest large;
+	MicroWrite write;
+	char * response;
+
+	// Nothing is listening; only the connection machinery is needed
+	webserve = check_connect(-1);
+	socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+	value = 1 << 20;
+	setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+	setsockopt(pair[1], SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+	set_nonblocking(pair[0]);
+	set_nonblocking(pair[1]);
+
+	connection = conversation_new(webserve, pair[0]);
+	connection->buffer = buffer_acquire(webserve);
+	connection->buffer_size = BUFSIZE;
+
+	small.request = "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	small.length = strlen(small.request);
+	large.request = "POST /submit/form HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+		"Accept-Language: en-GB,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Referer: https://www.example.com/submit/\r\n"
+		"Content-Type: application/x-www-form-urlencoded\r\n"
+		"Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; consent=yes\r\n"
+		"Connection: keep-alive\r\n"
+		"Content-Length: 27\r\n"
+		"\r\n"
+		"name=ThreadlessWeb&value=42";
+	large.length = strlen(large.request);
+
+	printf("%-24s %10s %10s %10s %10s\n", "benchmark", "ns/op", "p50", "p99", "max");
+	micro_run("parse small header", micro_parse, webserve, connection, &small);
+	micro_run("parse large header", micro_parse, webserve, connection, &large);
+
+	micro_run("prepare default", micro_prepare, webserve, connection, NULL);
+	connection->conversation.response_prepared = add_response(webserve, 200, "text/plain", "Prepared earlier\n", 17);
+	micro_run("prepare registered", micro_prepare, webserve, connection, NULL);
+	connection->conversation.response_prepared = NULL;
+
+	write.drain = pair[1];
+	write.sink = malloc(1 << 16);
+	micro_run("write default", micro_write, webserve, connection, &write);
+	response = malloc(16384);
+	memset(response, 'z', 16384);
+	connection->conversation.response = response;
+	connection->conversation.response_size = 16384;
+	micro_run("write 16k", micro_write, webserve, connection, &write);
+	connection->conversation.response = NULL;
+
+	free(response);
+	free(write.sink);
+	conversation_clear(webserve, pair[0]);
+	close(pair[1]);
+	finish_server(webserve);
+
+	return 0;
+}
+
+uint64_t time_nsec() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+int compare_nsec(void const * first, void const * second) {
+	double a;
+	double b;
+
+	a = *(double const *)first;
+	b = *(double const *)second;
+
+	return (a > b) - (a < b);
+}
+
+void micro_run(char const * name, MicroFunction function, Webserve * webserve, Connection * connection, void * data) {
+	double * batches;
+	double total;
+	uint64_t start;
+	int batch;
+	int op;
+
+	// Timing batches keeps the cost of reading the clock out of the figures
+	batches = malloc(sizeof(double) * MICRO_BATCHES);
+	total = 0;
+	for (batch = 0; batch < MICRO_BATCHES; batch++) {
+		start = time_nsec();
+		for (op = 0; op < MICRO_BATCH; op++) {
+			function(webserve, connection, data);
+		}
+		batches[batch] = (double)(time_nsec() - start) / MICRO_BATCH;
+		total += batches[batch];
+	}
+
+	qsort(batches, MICRO_BATCHES, sizeof(double), compare_nsec);
+	printf("%-24s %10.1f %10.1f %10.1f %10.1f\n", name, total / MICRO_BATCHES, batches[MICRO_BATCHES / 2], batches[(MICRO_BATCHES * 99) / 100], batches[MICRO_BATCHES - 1]);
+	free(batches);
+}
+
+void micro_parse(Webserve * webserve, Connection * connection, void * data) {
+	MicroRequest * request;
+
+	request = (MicroRequest *)data;
+	memcpy(connection->buffer, request->request, request->length);
+	connection->buffer_used = request->length;
+	connection->parse = PARSE_HEADER;
+	connection->scanned = 0;
+	connection->path_start = 0;
+	connection->path_end = 0;
+	connection->line_end = 0;
+	web_parse(webserve, connection->fd, connection);
+}
+
+void micro_prepare(Webserve * webserve, Connection * connection, void * data) {
+	web_prepare(webserve, connection);
+}
+
+void micro_write(Webserve * webserve, Connection * connection, void * data) {
+	MicroWrite * write;
+
+	write = (MicroWrite *)data;
+	web_prepare(webserve, connection);
+	while (web_write(webserve, connection->fd, connection) == WRITE_PENDING) {
+		while (read(write->drain, write->sink, 1 << 16) > 0) {
+		}
+	}
+	// Draining is part of the cost, as it would be for a real client
+	while (read(write->drain, write->sink, 1 << 16) > 0) {
+	}
+}
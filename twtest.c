@@ -0,0 +1,574 @@
+/**
+ * @file
+ * @author  David Llewellyn-Jones <david@flypig.co.uk>
+ * @version 1.0
+ *
+ * @section LICENSE
+ *
+ * @brief Checks for the parts of ThreadlessWeb that are easy to get wrong
+ * @section DESCRIPTION
+ *
+ * Runs the library's parsing and negotiation functions against tables of
+ * inputs and the results they should give, printing any that don't match. The
+ * library source is included directly so that its internal functions can be
+ * called.
+ *
+ */
+
+#include "threadlessweb.c"
+#include <poll.h>
+
+// Defines
+
+#define TEST_ZLIB ((1 << ENCODING_DEFLATE) | (1 << ENCODING_GZIP))
+#define TEST_CLIENTS 10
+#define TEST_FDS 1024
+
+// Structure definitions
+
+typedef struct _TestEncoding {
+	char const * accept;
+	unsigned int available;
+	ENCODING expected;
+} TestEncoding;
+
+typedef struct _TestLength {
+	char const * value;
+	bool valid;
+	size_t length;
+} TestLength;
+
+typedef struct _TestRoute {
+	REQUEST method;
+	char const * path;
+	WebservConvCallback expected;
+} TestRoute;
+
+typedef struct _TestCache {
+	char const * request;
+	bool hit;
+} TestCache;
+
+typedef struct _TestWatch {
+	// The events the server wants for each descriptor, as an outside loop sees them
+	int events[TEST_FDS];
+} TestWatch;
+
+typedef struct _TestRequest {
+	char const * request;
+	// The status line of the refusal, or NULL if the request should be accepted
+	char const * refusal;
+	bool keep_alive;
+} TestRequest;
+
+// Function prototypes
+
+unsigned int test_encodings();
+unsigned int test_lengths();
+unsigned int test_requests();
+unsigned int test_routes();
+unsigned int test_declined();
+unsigned int test_cache();
+unsigned int test_arena();
+unsigned int test_handover();
+unsigned int test_variants();
+void test_fd_callback(Webserve * webserve, int fd, int events, void * data);
+bool test_route_get(WebserveConv * conversation);
+bool test_route_head(WebserveConv * conversation);
+bool test_route_any(WebserveConv * conversation);
+bool test_decline(WebserveConv * conversation);
+
+// Function definitions
+
+int main(int argc, char ** argv) {
+	unsigned int failures;
+
+	failures = 0;
+	failures += test_encodings();
+	failures += test_lengths();
+	failures += test_requests();
+	failures += test_routes();
+	failures += test_declined();
+	failures += test_cache();
+	failures += test_arena();
+	failures += test_handover();
+	failures += test_variants();
+
+	printf("%s: %u failures\n", (failures == 0) ? "PASS" : "FAIL", failures);
+
+	return (failures == 0) ? 0 : 1;
+}
+
+unsigned int test_encodings() {
+	static TestEncoding const cases[] = {
+		{NULL, TEST_ZLIB, ENCODING_IDENTITY},
+		{"", TEST_ZLIB, ENCODING_IDENTITY},
+		{"gzip", TEST_ZLIB, ENCODING_GZIP},
+		{"deflate", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip, deflate", TEST_ZLIB, ENCODING_GZIP},
+		{"gzip", 0, ENCODING_IDENTITY},
+		{"GZIP", TEST_ZLIB, ENCODING_GZIP},
+		{"gzip;q=0", TEST_ZLIB, ENCODING_IDENTITY},
+		{"gzip;q=0,deflate", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip;q=0, deflate", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip;q=0.000,deflate", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip;q=0.,deflate", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip ; q = 0 , deflate", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip;Q=0,deflate", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip;q=0.5,deflate;q=0.6", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip;q=1,deflate;q=0.9", TEST_ZLIB, ENCODING_GZIP},
+		{"gzip;q=1.0,deflate;q=0.999", TEST_ZLIB, ENCODING_GZIP},
+		{"deflate;q=0.001,gzip;q=0", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip;level=9;q=0,deflate", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip;q=", TEST_ZLIB, ENCODING_GZIP},
+		{"gzip;q=0x,deflate;q=0.5", TEST_ZLIB, ENCODING_GZIP},
+		{"gzip;qq=0", TEST_ZLIB, ENCODING_GZIP},
+		{"*", TEST_ZLIB, ENCODING_GZIP},
+		{"*;q=0,deflate", TEST_ZLIB, ENCODING_DEFLATE},
+		{"gzip;q=0,*", TEST_ZLIB, ENCODING_DEFLATE},
+		{"identity", TEST_ZLIB, ENCODING_IDENTITY},
+		{"gzipx, deflate;q=0", TEST_ZLIB, ENCODING_IDENTITY},
+		{"deflate;q=0", TEST_ZLIB, ENCODING_IDENTITY},
+		{"gzip;q=0.5", TEST_ZLIB, ENCODING_GZIP},
+		{"gzip;q=0,", TEST_ZLIB, ENCODING_IDENTITY},
+		{"gzip;", TEST_ZLIB, ENCODING_GZIP},
+		{";q=0,gzip", TEST_ZLIB, ENCODING_GZIP},
+	};
+	WebserveConv conversation;
+	ENCODING chosen;
+	unsigned int index;
+	unsigned int failures;
+
+	failures = 0;
+	for (index = 0; index < sizeof(cases) / sizeof(cases[0]); index++) {
+		memset(&conversation, 0, sizeof(conversation));
+		conversation.known[HEADER_ACCEPT_ENCODING].data = cases[index].accept;
+		conversation.known[HEADER_ACCEPT_ENCODING].size = (cases[index].accept != NULL) ? strlen(cases[index].accept) : 0;
+		chosen = encoding_choose(&conversation, cases[index].available);
+		if (chosen != cases[index].expected) {
+			printf("encoding \"%s\": got %s, expected %s\n", (cases[index].accept != NULL) ? cases[index].accept : "", encodings[chosen], encodings[cases[index].expected]);
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+unsigned int test_lengths() {
+	static TestLength const cases[] = {
+		{"0", true, 0},
+		{"42", true, 42},
+		{" 42 ", true, 42},
+		{"42, 42", true, 42},
+		{"18446744073709551615", true, SIZE_MAX},
+		{"", false, 0},
+		{" ", false, 0},
+		{"+42", false, 0},
+		{"-1", false, 0},
+		{"42abc", false, 0},
+		{"4 2", false, 0},
+		{"0x10", false, 0},
+		{"42, 43", false, 0},
+		{"42,", false, 0},
+		{",42", false, 0},
+		{"18446744073709551616", false, 0},
+		{"99999999999999999999999", false, 0},
+	};
+	size_t length;
+	bool valid;
+	unsigned int index;
+	unsigned int failures;
+
+	failures = 0;
+	for (index = 0; index < sizeof(cases) / sizeof(cases[0]); index++) {
+		valid = content_length_parse(cases[index].value, strlen(cases[index].value), &length);
+		if ((valid != cases[index].valid) || (valid && (length != cases[index].length))) {
+			printf("content length \"%s\": got %s %zu\n", cases[index].value, valid ? "valid" : "invalid", length);
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+unsigned int test_requests() {
+	static TestRequest const cases[] = {
+		{"GET / HTTP/1.1\r\nHost: x\r\n\r\n", NULL, true},
+		{"GET / HTTP/1.0\r\n\r\n", NULL, false},
+		{"POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello", NULL, true},
+		{"POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\nhello", NULL, true},
+		{"POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\nhello!", "HTTP/1.1 400", false},
+		{"POST / HTTP/1.1\r\nContent-Length: +5\r\n\r\nhello", "HTTP/1.1 400", false},
+		{"POST / HTTP/1.1\r\nContent-Length: 5x\r\n\r\nhello", "HTTP/1.1 400", false},
+		{"POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", "HTTP/1.1 400", false},
+		{"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n", NULL, true},
+		{"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n5\r\nhello\r\n0\r\n\r\n", NULL, false},
+		{"GET\r\n\r\n", "HTTP/1.1 400", false},
+		{"FOO / HTTP/1.1\r\n\r\n", "HTTP/1.1 403", false},
+	};
+	Webserve * webserve;
+	Connection * connection;
+	char received[256];
+	int pair[2];
+	size_t length;
+	ssize_t size;
+	READ result;
+	unsigned int index;
+	unsigned int failures;
+
+	// Nothing is listening; requests are parsed straight from the buffer
+	webserve = check_connect(-1);
+	failures = 0;
+	for (index = 0; index < sizeof(cases) / sizeof(cases[0]); index++) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+		set_nonblocking(pair[1]);
+		connection = conversation_new(webserve, pair[0]);
+		connection->buffer = buffer_acquire(webserve);
+		connection->buffer_size = BUFSIZE;
+		length = strlen(cases[index].request);
+		memcpy(connection->buffer, cases[index].request, length);
+		connection->buffer_used = length;
+
+		result = web_parse(webserve, pair[0], connection);
+		size = read(pair[1], received, sizeof(received) - 1);
+		received[(size > 0) ? size : 0] = '\0';
+		if (cases[index].refusal != NULL) {
+			if ((result != READ_ERROR) || (strncmp(received, cases[index].refusal, strlen(cases[index].refusal)) != 0)) {
+				printf("request %u: expected refusal %s, got \"%.12s\"\n", index, cases[index].refusal, received);
+				failures++;
+			}
+		}
+		else if ((result != READ_COMPLETE) || (connection->keep_alive != cases[index].keep_alive)) {
+			printf("request %u: parsed %d, keep alive %d\n", index, result, connection->keep_alive);
+			failures++;
+		}
+
+		conversation_clear(webserve, pair[0]);
+		close(pair[0]);
+		close(pair[1]);
+	}
+	finish_server(webserve);
+
+	return failures;
+}
+
+unsigned int test_routes() {
+	static TestRoute const cases[] = {
+		{REQUEST_GET, "/page", test_route_get},
+		{REQUEST_HEAD, "/page", test_route_get},
+		{REQUEST_POST, "/page", NULL},
+		{REQUEST_GET, "/both", test_route_get},
+		{REQUEST_HEAD, "/both", test_route_head},
+		{REQUEST_HEAD, "/any", test_route_any},
+		{REQUEST_HEAD, "/mixed", test_route_get},
+		{REQUEST_POST, "/mixed", test_route_any},
+		{REQUEST_HEAD, "/none", NULL},
+	};
+	Webserve * webserve;
+	WebserveConv conversation;
+	WebservConvCallback callback;
+	unsigned int index;
+	unsigned int failures;
+
+	webserve = check_connect(-1);
+	add_route(webserve, REQUEST_GET, "/page", test_route_get);
+	add_route(webserve, REQUEST_GET, "/both", test_route_get);
+	add_route(webserve, REQUEST_HEAD, "/both", test_route_head);
+	add_route(webserve, REQUEST_ANY, "/any", test_route_any);
+	add_route(webserve, REQUEST_GET, "/mixed", test_route_get);
+	add_route(webserve, REQUEST_ANY, "/mixed", test_route_any);
+
+	failures = 0;
+	for (index = 0; index < sizeof(cases) / sizeof(cases[0]); index++) {
+		memset(&conversation, 0, sizeof(conversation));
+		callback = route_find(webserve->routes, cases[index].path, strlen(cases[index].path), cases[index].method, &conversation);
+		if (callback != cases[index].expected) {
+			printf("route %s %s: wrong callback\n", requests[cases[index].method], cases[index].path);
+			failures++;
+		}
+	}
+	finish_server(webserve);
+
+	return failures;
+}
+
+unsigned int test_declined() {
+	static char const request[] = "GET / HTTP/1.1\r\nHost: x\r\n\r\n";
+	Webserve * webserve;
+	Connection * connection;
+	int pair[2];
+	unsigned int failures;
+
+	// A callback that returns false gets the default response in place of its own
+	webserve = check_connect(-1);
+	set_conv_callback(webserve, test_decline);
+	socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+	connection = conversation_new(webserve, pair[0]);
+	connection->buffer = buffer_acquire(webserve);
+	connection->buffer_size = BUFSIZE;
+	memcpy(connection->buffer, request, sizeof(request) - 1);
+	connection->buffer_used = sizeof(request) - 1;
+	web_parse(webserve, pair[0], connection);
+	conversation_respond(webserve, connection);
+	failures = 0;
+	if ((connection->conversation.response_size != RESPONSE_LENGTH) || (memcmp(connection->conversation.response, RESPONSE_CONTENT, RESPONSE_LENGTH) != 0)) {
+		printf("declined: got \"%.*s\"\n", (int)connection->conversation.response_size, connection->conversation.response);
+		failures++;
+	}
+
+	conversation_clear(webserve, pair[0]);
+	close(pair[0]);
+	close(pair[1]);
+	finish_server(webserve);
+
+	return failures;
+}
+
+unsigned int test_cache() {
+	static TestCache const cases[] = {
+		{"GET /page HTTP/1.1\r\nHost: a\r\n\r\n", false},
+		{"GET /page HTTP/1.1\r\nHost: a\r\n\r\n", true},
+		{"GET /page HTTP/1.1\r\nHost: b\r\n\r\n", false},
+		{"HEAD /page HTTP/1.1\r\nHost: a\r\n\r\n", false},
+		{"HEAD /page HTTP/1.1\r\nHost: a\r\n\r\n", true},
+		{"GET /page HTTP/1.1\r\nHost: b\r\n\r\n", true},
+	};
+	Webserve * webserve;
+	Connection * connection;
+	unsigned long hits;
+	size_t length;
+	int pair[2];
+	unsigned int index;
+	unsigned int failures;
+
+	// Entries are only shared by requests with the same method and host
+	webserve = check_connect(-1);
+	set_response_cache(webserve, 1024 * 1024, 60000000);
+	failures = 0;
+	for (index = 0; index < sizeof(cases) / sizeof(cases[0]); index++) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+		connection = conversation_new(webserve, pair[0]);
+		connection->buffer = buffer_acquire(webserve);
+		connection->buffer_size = BUFSIZE;
+		length = strlen(cases[index].request);
+		memcpy(connection->buffer, cases[index].request, length);
+		connection->buffer_used = length;
+		web_parse(webserve, pair[0], connection);
+		hits = webserve->stats.cache_hits;
+		conversation_respond(webserve, connection);
+		if ((webserve->stats.cache_hits > hits) != cases[index].hit) {
+			printf("cache %u: expected %s\n", index, cases[index].hit ? "a hit" : "a miss");
+			failures++;
+		}
+
+		conversation_clear(webserve, pair[0]);
+		close(pair[0]);
+		close(pair[1]);
+	}
+	finish_server(webserve);
+
+	return failures;
+}
+
+unsigned int test_arena() {
+	Webserve * webserve;
+	Connection * usual;
+	Connection * large;
+	ArenaBlock * kept;
+	unsigned int failures;
+
+	// The connections are never read from or written to
+	webserve = check_connect(-1);
+	usual = conversation_new(webserve, 0);
+	large = conversation_new(webserve, 1);
+	failures = 0;
+
+	// A block of the usual size is kept for the next conversation
+	conv_alloc(&usual->conversation, 64);
+	conv_alloc(&usual->conversation, 2 * ARENA_BLOCK);
+	kept = usual->arena->next;
+	arena_reset(usual);
+	if ((usual->arena != kept) || (usual->arena->used != 0)) {
+		printf("arena: usual block not kept\n");
+		failures++;
+	}
+
+	// But one made larger for a single allocation goes
+	conv_alloc(&large->conversation, 16 * ARENA_BLOCK);
+	arena_reset(large);
+	if (large->arena != NULL) {
+		printf("arena: large block kept\n");
+		failures++;
+	}
+
+	conversation_clear(webserve, 0);
+	conversation_clear(webserve, 1);
+	finish_server(webserve);
+
+	return failures;
+}
+
+unsigned int test_handover() {
+	Webserve * webserve;
+	TestWatch watch;
+	struct sockaddr_un address;
+	struct pollfd fds[TEST_FDS];
+	char path[64];
+	char received[TEST_CLIENTS][32];
+	int clients[TEST_CLIENTS];
+	int served;
+	int count;
+	int fd;
+	int index;
+	int tries;
+	ssize_t size;
+	unsigned int failures;
+
+	// The server's own loop runs first, then an outside one takes over
+	snprintf(path, sizeof(path), "/tmp/twtest-%d.sock", (int)getpid());
+	unlink(path);
+	webserve = start_server_empty();
+	add_listener_unix(webserve, path, NULL);
+	for (index = 0; index < 5; index++) {
+		poll_for(webserve, 2000);
+	}
+	memset(&watch, 0, sizeof(watch));
+	set_fd_callback(webserve, test_fd_callback, &watch);
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	for (index = 0; index < TEST_CLIENTS; index++) {
+		clients[index] = socket(AF_UNIX, SOCK_STREAM, 0);
+		connect(clients[index], (struct sockaddr *)&address, sizeof(address));
+		write(clients[index], "GET / HTTP/1.1\r\nHost: x\r\n\r\n", 27);
+		set_nonblocking(clients[index]);
+		received[index][0] = '\0';
+	}
+
+	served = 0;
+	for (tries = 0; (tries < 100) && (served < TEST_CLIENTS); tries++) {
+		count = 0;
+		for (fd = 0; fd < TEST_FDS; fd++) {
+			if (watch.events[fd] != 0) {
+				fds[count].fd = fd;
+				fds[count].events = ((watch.events[fd] & EVENT_READ) ? POLLIN : 0) | ((watch.events[fd] & EVENT_WRITE) ? POLLOUT : 0);
+				fds[count].revents = 0;
+				count++;
+			}
+		}
+		poll(fds, count, 20);
+		for (index = 0; index < count; index++) {
+			if (fds[index].revents != 0) {
+				process_events(webserve, fds[index].fd, ((fds[index].revents & (POLLIN | POLLHUP | POLLERR)) ? EVENT_READ : 0) | ((fds[index].revents & POLLOUT) ? EVENT_WRITE : 0));
+			}
+		}
+		served = 0;
+		for (index = 0; index < TEST_CLIENTS; index++) {
+			if (received[index][0] == '\0') {
+				size = read(clients[index], received[index], sizeof(received[index]) - 1);
+				received[index][(size > 0) ? size : 0] = '\0';
+			}
+			served += (strncmp(received[index], "HTTP/1.1 200", 12) == 0) ? 1 : 0;
+		}
+	}
+
+	failures = 0;
+	if (served != TEST_CLIENTS) {
+		printf("handover: %d of %d clients served\n", served, TEST_CLIENTS);
+		failures++;
+	}
+
+	for (index = 0; index < TEST_CLIENTS; index++) {
+		close(clients[index]);
+	}
+	finish_server(webserve);
+	unlink(path);
+
+	return failures;
+}
+
+unsigned int test_variants() {
+	static char const request[] = "GET / HTTP/1.1\r\nHost: x\r\nAccept-Encoding: gzip\r\n\r\n";
+	Webserve * webserve;
+	WebserveResponse * response;
+	WebserveResponse * variant;
+	Connection * connection;
+	char body[256];
+	char header[HEADER_SIZE];
+	size_t header_size;
+	int pair[2];
+	unsigned int failures;
+
+	// A compressed copy part way through being sent when the copies are rebuilt
+	webserve = check_connect(-1);
+	set_compression(webserve, 16);
+	memset(body, 'a', sizeof(body));
+	response = add_response(webserve, 200, "text/plain", body, sizeof(body));
+	socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+	connection = conversation_new(webserve, pair[0]);
+	connection->buffer = buffer_acquire(webserve);
+	connection->buffer_size = BUFSIZE;
+	memcpy(connection->buffer, request, sizeof(request) - 1);
+	connection->buffer_used = sizeof(request) - 1;
+	web_parse(webserve, pair[0], connection);
+	conv_send_response(&connection->conversation, response);
+	web_prepare(webserve, connection);
+	variant = connection->variant;
+	header_size = connection->send[SEND_HEADER].iov_len;
+	memcpy(header, connection->send[SEND_HEADER].iov_base, header_size);
+	failures = 0;
+	if ((variant == NULL) || (variant != response->variants[ENCODING_GZIP])) {
+		printf("variants: gzip copy not chosen\n");
+		failures++;
+	}
+
+	// It outlives the rebuild, and goes once the connection's done with it
+	set_compression(webserve, 32);
+	if ((variant != NULL) && ((variant == response->variants[ENCODING_GZIP]) || (variant->retired == false) || (variant->references != 1) || (memcmp(connection->send[SEND_HEADER].iov_base, header, header_size) != 0))) {
+		printf("variants: copy being sent not kept\n");
+		failures++;
+	}
+
+	conversation_clear(webserve, pair[0]);
+	close(pair[0]);
+	close(pair[1]);
+	finish_server(webserve);
+
+	return failures;
+}
+
+void test_fd_callback(Webserve * webserve, int fd, int events, void * data) {
+	if ((fd >= 0) && (fd < TEST_FDS)) {
+		((TestWatch *)data)->events[fd] = events;
+	}
+}
+
+bool test_route_get(WebserveConv * conversation) {
+	// The GET route, which HEAD falls back to
+	conversation->response_code = 200;
+
+	return true;
+}
+
+bool test_route_head(WebserveConv * conversation) {
+	// A HEAD route of its own, taking precedence over the GET one
+	conversation->response_code = 204;
+
+	return true;
+}
+
+bool test_route_any(WebserveConv * conversation) {
+	// A route for any method, used when nothing more specific matches
+	conversation->response_code = 202;
+
+	return true;
+}
+
+bool test_decline(WebserveConv * conversation) {
+	conversation->response = conv_alloc(conversation, 9);
+	memcpy(conversation->response, "Declined", 9);
+	conversation->response_size = 8;
+
+	return false;
+}